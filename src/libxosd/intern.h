@@ -4,22 +4,23 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <time.h>
-#ifndef timerclear /* {{{ */
-#define       timerisset(tvp)\
-	((tvp)->tv_sec || (tvp)->tv_usec)
-#define       timercmp(tvp, uvp, cmp)\
-	((tvp)->tv_sec cmp (uvp)->tv_sec ||\
-	 ((tvp)->tv_sec == (uvp)->tv_sec &&\
-	 (tvp)->tv_usec cmp (uvp)->tv_usec))
-#define       timerclear(tvp)\
-	((tvp)->tv_sec = (tvp)->tv_usec = 0)
-#endif /* }}} */
+#include <limits.h>
+#include <locale.h>
 #include <sys/select.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+#  include <sys/timerfd.h>
+#endif
 
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 
 #include <X11/Xlib.h>
@@ -29,6 +30,16 @@
 #ifdef HAVE_XINERAMA
 #  include <X11/extensions/Xinerama.h>
 #endif
+#ifdef HAVE_XFT
+#  include <wchar.h>
+#  include <X11/Xft/Xft.h>
+#endif
+#if defined(HAVE_XFT) && defined(HAVE_SYS_SHM_H) && defined(HAVE_X11_EXTENSIONS_XSHM_H)
+#  define USE_XSHM
+#  include <sys/ipc.h>
+#  include <sys/shm.h>
+#  include <X11/extensions/XShm.h>
+#endif
 
 #include "xosd.h"
 
@@ -69,44 +80,190 @@ union xosd_line
   enum LINE type;
   struct xosd_text {
     enum LINE type;
-    int width;
+    int width;                  /* logical, for layout and alignment */
+    int bearing;                /* left edge of the ink, valid with width */
+    int ink;                    /* width of the ink, valid with width */
     char *string;
+    int length;                 /* of string in bytes */
+    unsigned long hash;         /* of string when it was posted */
   } text;
   struct xosd_bar {
     enum LINE type;
     int value;
+    int drawn;                  /* segments on screen, -1 if to be redrawn */
   } bar;
 };
 
-struct xosd
+/* Requests posted by the API to the event thread. */
+#define XOSD_INLINE_TEXT 64
+enum CMD {
+  CMD_display, CMD_colour, CMD_shadow_colour, CMD_outline_colour, CMD_font,
+  CMD_shadow_offset, CMD_outline_offset, CMD_vertical_offset,
+  CMD_horizontal_offset, CMD_pos, CMD_align, CMD_bar_length, CMD_timeout,
+  CMD_hide, CMD_show, CMD_scroll, CMD_cache_size, CMD_extents, CMD_quit
+};
+struct xosd_cmd
+{
+  struct xosd_cmd *next;        /* next older command in queue */
+  unsigned long seq;            /* sequence number */
+  enum CMD type;
+  int value;                    /* line number or integer argument */
+  const char *name;             /* font or colour, owned by waiting caller */
+  union xosd_line line;         /* new line content for CMD_display */
+  int *result;                  /* return value for waiting caller,
+                                   CMD_extents also fills result[1..2] */
+  int borrowed;                 /* line.text.string is owned by the caller */
+  char *text;                   /* storage for long text, kept when pooled */
+  size_t text_size;
+  char inline_text[XOSD_INLINE_TEXT];   /* storage for short text */
+};
+/* Text storage of one line, reused by the following texts of that line. */
+struct xosd_buf
 {
-  pthread_t event_thread;       /* CONST handles X events */
+  char *data;
+  size_t size;
+};
+/* Longest string kept as key by the text caches, longer ones are not
+ * cached. Keys are stored in place, so a miss allocates nothing. */
+#define XOSD_CACHE_KEY 128
+/* Rendered text line kept by draw_text(). Font and offsets are not part of
+ * the key, because changing them drops the whole cache. The entry is stored
+ * relative to the text origin, so it stays valid when the alignment or the
+ * window width changes. Entries come from a pool of XOSD_CACHE_ENTRIES. */
+#define XOSD_CACHE_ENTRIES 64
+struct xosd_cache
+{
+  struct xosd_cache *prev, *next; /* LRU list, most recently used first */
+  unsigned long hash;           /* of string */
+  char string[XOSD_CACHE_KEY];
+  unsigned long pixel, shadow_pixel, outline_pixel;
+  int dx, width;                /* horizontal extent from the text origin */
+  Pixmap pixmap;                /* line content */
+  Pixmap mask;                  /* XShape of the content */
+  unsigned long bytes;          /* estimated server memory */
+};
+/* Measured text kept by text_extents(), direct mapped by the hash of the
+ * string. The font is not part of the key, because changing it drops the
+ * whole table. */
+#define XOSD_EXTENTS_SIZE 256
+struct xosd_extents
+{
+  unsigned long hash;           /* of string, 0 if unused */
+  char string[XOSD_CACHE_KEY];
+  int width, bearing, ink;
+};
+/* Colour kept by parse_colour(). */
+struct xosd_colour
+{
+  struct xosd_colour *next;
+  char *name;
+  XColor colour;                /* with pixel, if ok */
+  int ok;                       /* 0 if not parsed or allocated */
+};
+/* How long _xosd_post() blocks the caller. */
+enum POST { POST_async, POST_show, POST_sync };
 
-  pthread_mutex_t mutex;        /* CONST serialize X11 and structure */
-  pthread_cond_t cond_wait;     /* CONST signal X11 done */
-  int pipefd[2];                /* CONST signal X11 needed */
+/* One X11 connection and event thread shared by several xosd objects. */
+struct xosd_context
+{
+  int threaded;                 /* CONST 0 if driven by xosd_dispatch() */
+  pthread_t event_thread;       /* CONST handles X events and commands */
+  Display *display;             /* CONST x11 */
+  int wakefd[2];                /* CONST signal commands posted */
+  int timerfd;                  /* CONST earliest deadline, -1 if unused */
+  struct timespec timer_armed;  /* DYN (event thread) deadline of timerfd */
 
   pthread_mutex_t mutex_sync;   /* CONST mutual exclusion event notify */
   pthread_cond_t cond_sync;     /* CONST signal events */
+  int waiters;                  /* DYN (mutex_sync) threads waiting for
+                                   seq_done or generation */
 
-  Display *display;             /* CONST x11 */
+  enum { WM_unknown, WM_none, WM_gnome, WM_netwm } wm;  /* DYN (event thread) */
+  Atom wm_atoms[5];             /* DYN (event thread) used by stay_on_top() */
+
+  struct xosd_colour *colours;  /* DYN (mutex_sync) parse_colour() cache */
+
+  unsigned long wakeups;        /* DYN (event thread) see xosd_stats */
+  unsigned long select_timeouts;        /* DYN (event thread) */
+  int stats_interval;           /* CONST seconds between dumps, 0 if none */
+  struct timespec stats_next;   /* DYN (event thread) time of next dump */
+  struct timespec deadline;     /* DYN (event thread) next select()
+                                   timeout, 0 if none */
+
+  struct xosd *osds;            /* DYN (event thread) attached objects */
+  struct xosd *attach;          /* DYN (mutex_sync) objects to be set up */
+  int users;                    /* DYN number of xosd objects */
+  int done;                     /* DYN stop the event thread */
+};
+
+struct xosd
+{
+  xosd_context *context;        /* CONST */
+  int own_context;              /* CONST context created by xosd_create() */
+  struct xosd *next;            /* DYN (event thread) in context->osds */
+  int attached;                 /* DYN (mutex_sync) 1 set up, -1 failed */
+  int detached;                 /* DYN (mutex_sync) X resources released */
+  int on_top;                   /* DYN (event thread) stay_on_top() done */
+  int event_fd[2];              /* DYN (mutex_sync) xosd_get_event_fd() */
+  int events_on;                /* DYN (mutex_sync) event_fd is open */
+  int events;                   /* DYN pending xosd_event bits */
+
+  struct xosd_cmd *queue;       /* DYN posted commands, newest first */
+  unsigned long seq_posted;     /* DYN last sequence number handed out */
+  unsigned long seq_applied;    /* DYN (event thread) number of applied cmds */
+  unsigned long seq_max;        /* DYN (event thread) highest applied cmd */
+  unsigned long seq_done;       /* DYN all commands up to here applied */
+  struct xosd_cmd *cmd_pool;    /* DYN applied commands for reuse */
+  pthread_mutex_t mutex_pool;   /* CONST one taker of cmd_pool at a time */
+
+  pthread_mutex_t mutex_batch;  /* CONST one batch at a time */
+  struct xosd_cmd *batch_queue; /* DYN (batch owner) collected commands */
+  struct xosd_cmd *batch_last;  /* DYN (batch owner) oldest collected */
+  int batch_count;              /* DYN (batch owner) number collected */
+  int batch_wait;               /* DYN (batch owner) wait for show on commit */
+
+  Display *display;             /* CONST x11 of context */
   int screen;                   /* CONST x11 */
   Window window;                /* CONST x11 */
   unsigned int depth;           /* CONST x11 */
   Pixmap mask_bitmap;           /* CACHE (font,offset) XShape mask */
   Pixmap line_bitmap;           /* CACHE (font,offset) offscreen bitmap */
+  Pixmap band_bitmap;           /* CACHE (font,offset) XShape of one line */
+  Pixmap glyph_bitmap;          /* CACHE (font,offset) glyphs of one line */
+  Pixmap outline_bitmap;        /* CACHE (font,offset) dilated glyph_bitmap */
   Visual *visual;               /* CONST x11 */
 
+#ifdef HAVE_XFT
+  int xft;                      /* CONST render text through Xft */
+  XftFont *xftfont;             /* CONF font if xft */
+  XftDraw *xft_line;            /* CACHE (font,offset) draw to line_bitmap */
+  XftDraw *xft_glyph;           /* CACHE (font,offset) draw to glyph_bitmap */
+  int image;                    /* CONST rasterize on the client */
+  XImage *line_image;           /* CACHE (font,offset) client line_bitmap */
+  XImage *mask_image;           /* CACHE (font,offset) client mask_bitmap */
+  unsigned char *coverage;      /* CACHE (font,offset) glyph alpha of a line */
+  unsigned char *spread;        /* CACHE (font,offset) outline of a line */
+  FcChar32 *ucs;                /* DYN (event thread) _xft_string() result */
+  int ucs_size;                 /* DYN (event thread) characters in ucs */
+#endif
+#ifdef USE_XSHM
+  int shm;                      /* CONST line_image is shared memory */
+  XShmSegmentInfo shminfo;      /* CACHE (font,offset) of line_image */
+  int shm_completion;           /* CONST event type of ShmCompletion */
+  Drawable shm_busy;            /* DYN drawable still reading line_image or None */
+#endif
   XFontSet fontset;             /* CACHE (font) */
-  XRectangle *extent;           /* CACHE (font) */
+  XRectangle extent;            /* CACHE (font) */
 
   GC gc;                        /* CONST x11 */
   GC mask_gc;                   /* CONST x11 white on black to set XShape mask */
   GC mask_gc_back;              /* CONST x11 black on white to clear XShape mask */
+  GC mask_gc_or;                /* CONST x11 or bitmaps together */
 
   int screen_width;             /* CONST x11 */
   int screen_height;            /* CONST x11 */
   int screen_xpos;              /* CONST x11 */
+  int width;                    /* CACHE (content) of window and bitmaps */
   int height;                   /* CACHE (font) */
   int line_height;              /* CACHE (font) */
   xosd_pos pos;                 /* CONF */
@@ -121,8 +278,12 @@ struct xosd
   unsigned long outline_pixel;  /* CACHE (outline_colour) */
   int bar_length;               /* CONF */
 
+  int async;                    /* CONF never wait for window to be mapped */
   int generation;               /* DYN count of map/unmap */
-  int done;                     /* DYN */
+  int done;                     /* DYN (event thread) CMD_quit applied */
+  int no_font;                  /* DYN (event thread) last show had no font */
+  int batch;                    /* DYN nesting of xosd_begin_update() */
+  pthread_t batch_owner;        /* DYN thread holding the batch lock */
   enum {
     UPD_none = 0,       /* Nothing changed */
     UPD_hide = (1<<0),  /* Force hiding */
@@ -132,21 +293,58 @@ struct xosd
     UPD_lines = (1<<4), /* Redraw content */
     UPD_mask = (1<<5),  /* Update mask */
     UPD_size = (1<<6),  /* Change font and window size */
+    UPD_width = (1<<7), /* Resize window and bitmaps */
+    UPD_scroll = (1<<8),        /* Move content up by scrolled lines */
     UPD_content = UPD_mask | UPD_lines,
     UPD_font = UPD_size | UPD_mask | UPD_lines | UPD_pos
   } update;                     /* DYN */
 
   unsigned long pixel;          /* CACHE (pixel) */
   XColor colour;                /* CONF */
+  XColor set_colour;            /* DYN (mutex_sync) colour as last set by the
+                                   API, for xosd_get_colour() */
 
-  union xosd_line *lines;       /* CONF */
+  union xosd_line *lines;       /* CONF ring, see LINE() */
+  struct xosd_buf *line_bufs;   /* DYN (event thread) text storage of slots */
+  int first_line;               /* DYN (event thread) slot of line 0 */
+  int scrolled;                 /* DYN (event thread) lines to move up */
   int number_lines;             /* CONF */
+  unsigned long *dirty;         /* DYN bitmap of lines needing a redraw */
+  XRectangle *bar_rects;        /* DYN (event thread) draw_bar() scratch */
+  int bar_rects_size;           /* DYN (event thread) for that many segments */
 
-  int timeout;                  /* CONF delta time */
-  struct timeval timeout_start; /* DYN Absolute start of timeout */
+  struct xosd_cache *cache;     /* DYN (event thread) rendered lines, LRU */
+  struct xosd_cache *cache_last;        /* DYN (event thread) oldest entry */
+  struct xosd_cache *cache_pool;        /* DYN (event thread) all entries */
+  struct xosd_cache *cache_free;        /* DYN (event thread) unused entries */
+  unsigned long cache_size;     /* CONF byte budget of the cache */
+  struct xosd_extents extents_cache[XOSD_EXTENTS_SIZE]; /* CACHE (font) */
+  struct xosd_stats stats;      /* DYN (event thread) counters */
+  struct xosd_histogram wait;   /* DYN (mutex_sync) XOSD_stage_wait */
+
+  int timeout;                  /* CONF delta time in milliseconds */
+  struct timespec timeout_end;  /* DYN CLOCK_MONOTONIC deadline, 0 if none */
 };
 
-static const int XOSD_MAX_PRINTF_BUF_SIZE=2000;
+static const unsigned long XOSD_CACHE_SIZE=1024*1024;
+
+/* Lines are kept in a ring, so scrolling does not move them. */
+#define LINE_SLOT(osd, line) \
+  (((osd)->first_line + (line)) % (osd)->number_lines)
+#define LINE(osd, line) (&(osd)->lines[LINE_SLOT(osd, line)])
+
+/* Per-line dirty bitmap handling. {{{ */
+#define DIRTY_BITS (8 * sizeof(unsigned long))
+#define DIRTY_WORDS(n) (((n) + DIRTY_BITS - 1) / DIRTY_BITS)
+#define DIRTY_SET(osd, line) \
+  ((osd)->dirty[(line) / DIRTY_BITS] |= 1UL << ((line) % DIRTY_BITS))
+#define DIRTY_ISSET(osd, line) \
+  ((osd)->dirty[(line) / DIRTY_BITS] & (1UL << ((line) % DIRTY_BITS)))
+#define DIRTY_ALL(osd) \
+  memset((osd)->dirty, 0xff, DIRTY_WORDS((osd)->number_lines) * sizeof(unsigned long))
+#define DIRTY_CLEAR(osd) \
+  memset((osd)->dirty, 0, DIRTY_WORDS((osd)->number_lines) * sizeof(unsigned long))
+/* }}} */
 
 /* vim: foldmethod=marker tabstop=2 shiftwidth=2 expandtab
  */
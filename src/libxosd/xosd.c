@@ -35,21 +35,67 @@ const char *osd_default_colour = "green";
 /** Global error string. */
 char *xosd_error;
 
-/* Wait until display is in next state. {{{ */
+/* Runtime statistics. {{{
+ * Stages are timed with CLOCK_MONOTONIC into power-of-two histograms, which
+ * is cheap enough to be always on. */
+static unsigned long
+_xosd_clock_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+/* Count a duration of ns nanoseconds. */
 static void
-_wait_until_update(xosd * osd, int generation)
+_histogram_add(struct xosd_histogram *h, unsigned long ns)
 {
-  pthread_mutex_lock(&osd->mutex_sync);
-  while (osd->generation == generation) {
-    DEBUG(Dtrace, "waiting %d %d", generation, osd->generation);
-    pthread_cond_wait(&osd->cond_sync, &osd->mutex_sync);
+  unsigned long us = ns / 1000;
+  int bucket = 0;
+
+  while (us && bucket < XOSD_HISTOGRAM_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  h->count++;
+  h->total_ns += ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+  h->buckets[bucket]++;
+}
+/* Count the stage started at start, return the end time. */
+static unsigned long
+stage_done(xosd * osd, enum xosd_stage stage, unsigned long start)
+{
+  unsigned long end = _xosd_clock_ns();
+  _histogram_add(&osd->stats.stages[stage], end - start);
+  return end;
+}
+/* Print the counters of st for a display to stderr. */
+static void
+stats_print(const void *osd, const struct xosd_stats *st)
+{
+  static const char *stages[XOSD_STAGES] = {
+    "size", "pos", "lines", "mask", "copy", "flush", "wait"
+  };
+  int i;
+
+  fprintf(stderr, "xosd %p: %lu frames %lu suppressed %lu exposes "
+          "%lu wakeups %lu timeouts\n", osd, st->frames,
+          st->redraws_suppressed, st->expose_events, st->wakeups,
+          st->select_timeouts);
+  for (i = 0; i < XOSD_STAGES; i++) {
+    const struct xosd_histogram *h = &st->stages[i];
+    if (h->count == 0)
+      continue;
+    fprintf(stderr, "xosd %p: %-5s %8lu times %10.1f us mean %10.1f us max\n",
+            osd, stages[i], h->count, h->total_ns / 1e3 / h->count,
+            h->max_ns / 1e3);
   }
-  pthread_mutex_unlock(&osd->mutex_sync);
 }
 
 /* }}} */
 
-/* Serialize access to the X11 connection. {{{
+/* Hand API requests over to the event thread. {{{
  *
  * Background: xosd needs a thread which handles X11 exposures. XNextEvent()
  * blocks and would deny any other thread - especially the thread which calls
@@ -58,951 +104,3769 @@ _wait_until_update(xosd * osd, int generation)
  * the loading application has done its first X11 call, after which calling
  * XInitThreads() is no longer possible. (Debian-Bug #252170)
  *
- * The exposure-thread gets the MUTEX and sleeps on a select([X11,pipe]). When
- * an X11 event occurs, the tread can directly use X11 calls.
- * When another thread needs to do an X11 call, it uses _xosd_lock(osd) to
- * notify the exposure-thread via the pipe, which uses cond_wait to voluntarily
- * pass the right to access X11 to the signalling thread. The calling thread
- * acquire the MUTEX and can than use the X11 calls.
- * After using X11, the thread calls _xosd_unlock(osd) to remove its token from
- * the pipe and to wake up the exposure-thread via cond_signal, before
- * releasing the MUTEX.
- * The number of characters in the pipe is an indication for the number of
- * threads waiting for the X11-MUTEX.
+ * Therefore only the event-thread uses the X11 connection. It and the
+ * connection belong to a xosd_context, which might be shared by several
+ * objects. The API functions
+ * wrap their request into an immutable struct xosd_cmd and push it onto the
+ * LIFO osd->queue with a single atomic exchange. Unlike a compare-and-swap
+ * loop this never retries, so under contention every producer gets through
+ * in the order it reached the queue. The thread finding the queue empty
+ * wakes the event-thread via context->wakefd; everybody else knows that a
+ * wakeup is already pending, so the requests of all threads arriving in the
+ * meantime are handed over together. The event-thread takes the whole queue
+ * with one atomic exchange, applies all commands in posting order and then
+ * updates the display once.
+ * Each command gets a sequence number. osd->seq_done is the highest number up
+ * to which all commands have been applied; threads needing a result or a
+ * mapped window wait for their number on context->cond_sync. The event-thread
+ * only takes context->mutex_sync to signal them if context->waiters says that
+ * somebody waits at all.
+ * Between xosd_begin_update() and xosd_commit() the commands are collected in
+ * osd->batch_queue and pushed as one chain, so they are drawn together.
+ * A context created by xosd_create_unthreaded() has no event-thread: the
+ * application calls xosd_dispatch() when one of the descriptors returned by
+ * xosd_get_fds() gets readable, and waiting API calls apply the queue
+ * themselves, so nobody ever blocks on cond_sync.
  */
+static int
+_xosd_in_batch(xosd * osd)
+{
+  pthread_t owner;
+
+  /* Pairs with the release in xosd_begin_update(): whoever sees the flag
+   * also sees the owner stored before it, not one of an earlier batch. */
+  if (!__atomic_load_n(&osd->batch, __ATOMIC_ACQUIRE))
+    return 0;
+  __atomic_load(&osd->batch_owner, &owner, __ATOMIC_RELAXED);
+  return pthread_equal(owner, pthread_self());
+}
+/* A non-blocking eventfd, or a pipe without it, to make poll() return. */
+static int
+_xosd_notify_open(int fd[2])
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK);
+  return fd[0];
+#else
+  if (pipe(fd) == -1)
+    return -1;
+  /* A full pipe already signals, so the writer must not block. */
+  fcntl(fd[1], F_SETFL, O_NONBLOCK);
+  return fcntl(fd[0], F_SETFL, O_NONBLOCK);
+#endif
+}
+static void
+_xosd_notify_close(int fd[2])
+{
+  close(fd[0]);
+  if (fd[1] != fd[0])
+    close(fd[1]);
+}
 static /*inline */ void
-_xosd_lock(xosd * osd)
+_xosd_notify(int fd[2])
 {
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t c = 1;
+#else
   char c = 0;
+#endif
   FUNCTION_START(Dlocking);
-  write(osd->pipefd[1], &c, sizeof(c));
-  pthread_mutex_lock(&osd->mutex);
-  FUNCTION_END(Dlocking);
+  write(fd[1], &c, sizeof(c));
 }
-static /*inline */ void
-_xosd_unlock(xosd * osd)
+static void
+_xosd_notify_drain(int fd[2])
 {
-  char c;
-  int generation = osd->generation, update = osd->update;
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t c;
+#else
+  char c[64];
+#endif
   FUNCTION_START(Dlocking);
-  read(osd->pipefd[0], &c, sizeof(c));
-  pthread_cond_signal(&osd->cond_wait);
-  pthread_mutex_unlock(&osd->mutex);
-  if (update & UPD_show)
-    _wait_until_update(osd, generation & ~1); /* no wait when already shown. */
-  FUNCTION_END(Dlocking);
+  while (read(fd[0], &c, sizeof(c)) == sizeof(c));
+}
+static /*inline */ void
+_xosd_wakeup(xosd_context * ctx)
+{
+  _xosd_notify(ctx->wakefd);
 }
 
-/* }}} */
+static struct timeval *dispatch(xosd_context * ctx, struct timeval *tv);
+static int wait_fds(xosd_context * ctx, struct timeval *tvp);
 
-/* Draw percentage/slider bar. {{{ */
-static void                     /*inline */
-_draw_bar(xosd * osd, int nbars, int on, XRectangle * p, XRectangle * mod,
-          int is_slider)
+/* Without event-thread do its work right away in the calling thread. */
+static void
+_xosd_run(xosd_context * ctx)
 {
-  int i;
-  XRectangle rs[2];
-  FUNCTION_START(Dfunction);
+  struct timeval tv;
 
-  rs[0].x = rs[1].x = mod->x + p->x;
-  rs[0].y = (rs[1].y = mod->y + p->y) + p->height / 3;
-  rs[0].width = mod->width + p->width * SLIDER_SCALE;
-  rs[0].height = mod->height + p->height / 3;
-  rs[1].width = mod->width + p->width * SLIDER_SCALE_ON;
-  rs[1].height = mod->height + p->height;
-  for (i = 0; i < nbars; i++, rs[0].x = rs[1].x += p->width) {
-    XRectangle *r = &(rs[is_slider ? (i == on) : (i < on)]);
-    XFillRectangles(osd->display, osd->mask_bitmap, osd->mask_gc, r, 1);
-    XFillRectangles(osd->display, osd->line_bitmap, osd->gc, r, 1);
-  }
-  FUNCTION_END(Dfunction);
+  if (ctx->threaded)
+    return;
+  /* The wakeup for the commands applied now is obsolete. */
+  _xosd_notify_drain(ctx->wakefd);
+  dispatch(ctx, &tv);
 }
+
+/* Wait until all commands up to seq have been applied. */
 static void
-draw_bar(xosd * osd, int line)
+_xosd_wait_seq(xosd * osd, unsigned long seq)
 {
-  struct xosd_bar *l = &osd->lines[line].bar;
-  int is_slider = l->type == LINE_slider, nbars, on;
-  XRectangle p, m;
-  p.x = XOFFSET;
-  p.y = osd->line_height * line;
-  p.width = -osd->extent->y / 2;
-  p.height = -osd->extent->y;
+  xosd_context *ctx = osd->context;
+  unsigned long start = _xosd_clock_ns();
 
-  assert(osd);
-  FUNCTION_START(Dfunction);
-
-  /* Calculate number of bars in automatic mode */
-  if (osd->bar_length == -1) {
-    nbars = (osd->screen_width * SLIDER_SCALE) / p.width;
-    switch (osd->align) {
-    case XOSD_center:
-      p.x = osd->screen_width * ((1 - SLIDER_SCALE) / 2);
-      break;
-    case XOSD_right:
-      p.x = osd->screen_width * (1 - SLIDER_SCALE);
-    case XOSD_left:
-      break;
-    }
-  } else {
-    nbars = osd->bar_length;
-    switch (osd->align) {
-    case XOSD_center:
-      p.x = (osd->screen_width - (nbars * p.width)) / 2;
-      break;
-    case XOSD_right:
-      p.x = osd->screen_width - (nbars * p.width) - p.x;
-    case XOSD_left:
-      break;
-    }
+  FUNCTION_START(Dlocking);
+  if (!ctx->threaded) {
+    /* Nobody else applies commands, so all are done afterwards. */
+    _xosd_run(ctx);
+    _histogram_add(&osd->wait, _xosd_clock_ns() - start);
+    return;
   }
-  on = ((nbars - is_slider) * l->value) / 100;
-
-  DEBUG(Dvalue, "percent=%d, nbars=%d, on=%d", l->value, nbars, on);
-
-  /* Outline */
-  if (osd->outline_offset) {
-    m.x = m.y = -osd->outline_offset;
-    m.width = m.height = 2 * osd->outline_offset;
-    XSetForeground(osd->display, osd->gc, osd->outline_pixel);
-    _draw_bar(osd, nbars, on, &p, &m, is_slider);
+  pthread_mutex_lock(&ctx->mutex_sync);
+  __sync_add_and_fetch(&ctx->waiters, 1);
+  while ((long) (osd->seq_done - seq) < 0 && !osd->detached) {
+    DEBUG(Dtrace, "waiting %lu %lu", seq, osd->seq_done);
+    pthread_cond_wait(&ctx->cond_sync, &ctx->mutex_sync);
   }
-  /* Shadow */
-  if (osd->shadow_offset) {
-    m.x = m.y = osd->shadow_offset;
-    m.width = m.height = 0;
-    XSetForeground(osd->display, osd->gc, osd->shadow_pixel);
-    _draw_bar(osd, nbars, on, &p, &m, is_slider);
+  __sync_sub_and_fetch(&ctx->waiters, 1);
+  _histogram_add(&osd->wait, _xosd_clock_ns() - start);
+  pthread_mutex_unlock(&ctx->mutex_sync);
+  FUNCTION_END(Dlocking);
+}
+
+/* Wait until display is in next state. */
+static void
+_wait_until_update(xosd * osd, int generation)
+{
+  xosd_context *ctx = osd->context;
+
+  if (!ctx->threaded) {
+    struct timeval tv, *tvp;
+    _xosd_notify_drain(ctx->wakefd);
+    for (;;) {
+      tvp = dispatch(ctx, &tv);
+      if (osd->generation != generation || wait_fds(ctx, tvp) == -1)
+        return;
+    }
   }
-  /* Bar/Slider */
-  if (1) {
-    m.x = m.y = m.width = m.height = 0;
-    XSetForeground(osd->display, osd->gc, osd->pixel);
-    _draw_bar(osd, nbars, on, &p, &m, is_slider);
+  pthread_mutex_lock(&ctx->mutex_sync);
+  __sync_add_and_fetch(&ctx->waiters, 1);
+  while (osd->generation == generation && !osd->detached) {
+    DEBUG(Dtrace, "waiting %d %d", generation, osd->generation);
+    pthread_cond_wait(&ctx->cond_sync, &ctx->mutex_sync);
   }
+  __sync_sub_and_fetch(&ctx->waiters, 1);
+  pthread_mutex_unlock(&ctx->mutex_sync);
 }
 
-/* }}} */
+/* Link of a command pushed onto the queue, until its pusher sets it. */
+#define CMD_PENDING ((struct xosd_cmd *) 1)
 
-/* Draw text. {{{ */
-static void                     /*inline */
-_draw_text(xosd * osd, char *string, int x, int y)
+/* Push the chain first..last of count commands, linked newest first. The
+ * chain is linked to the older commands right after the exchange; the
+ * event-thread waits for that link if it takes the queue in between. */
+static unsigned long
+_xosd_push(xosd * osd, struct xosd_cmd *first, struct xosd_cmd *last,
+           int count)
 {
-  int len = strlen(string);
-  FUNCTION_START(Dfunction);
-  XmbDrawString(osd->display, osd->mask_bitmap, osd->fontset, osd->mask_gc, x,
-                y, string, len);
-  XmbDrawString(osd->display, osd->line_bitmap, osd->fontset, osd->gc, x, y,
-                string, len);
-  FUNCTION_END(Dfunction);
+  struct xosd_cmd *old, *cmd;
+  unsigned long seq;
+  int i;
+
+  FUNCTION_START(Dlocking);
+  seq = __sync_add_and_fetch(&osd->seq_posted, count);
+  for (i = 0, cmd = first; i < count; i++, cmd = cmd->next)
+    cmd->seq = seq - i;
+  last->next = CMD_PENDING;
+  old = __atomic_exchange_n(&osd->queue, first, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&last->next, old, __ATOMIC_RELEASE);
+  if (old == NULL)
+    _xosd_wakeup(osd->context);
+  FUNCTION_END(Dlocking);
+  return seq;
 }
-static void
-draw_text(xosd * osd, int line)
+
+/* Push the commands collected by the current batch. */
+static unsigned long
+_xosd_push_batch(xosd * osd)
 {
-  int x = XOFFSET, y = osd->line_height * line - osd->extent->y;
-  struct xosd_text *l = &osd->lines[line].text;
+  unsigned long seq;
 
-  assert(osd);
-  FUNCTION_START(Dfunction);
+  seq = _xosd_push(osd, osd->batch_queue, osd->batch_last, osd->batch_count);
+  osd->batch_queue = NULL;
+  osd->batch_count = 0;
+  return seq;
+}
 
-  if (l->string == NULL)
-    return;
+/* Post a command to the event-thread and return its sequence number.
+ * POST_async returns at once, POST_show waits for a hidden display to be
+ * mapped, POST_sync waits until the command has been applied. Inside a batch
+ * only POST_sync waits; POST_show waits in xosd_commit(), and 0 is returned
+ * for the other commands as their number is assigned on commit. */
+static unsigned long
+_xosd_post(xosd * osd, struct xosd_cmd *cmd, enum POST mode)
+{
+  unsigned long seq;
 
-  if (l->width < 0) {
-    XRectangle rect;
-    XmbTextExtents(osd->fontset, l->string, strlen(l->string), NULL, &rect);
-    l->width = rect.width;
-  }
+  FUNCTION_START(Dlocking);
+  if (mode == POST_show && (osd->async || osd->generation & 1))
+    mode = POST_async;          /* no wait when already shown. */
+
+  if (_xosd_in_batch(osd)) {
+    if (osd->batch_queue == NULL)
+      osd->batch_last = cmd;
+    cmd->next = osd->batch_queue;
+    osd->batch_queue = cmd;
+    osd->batch_count++;
+    if (mode == POST_show)
+      osd->batch_wait = 1;
+    if (mode != POST_sync)
+      return 0;
+    seq = _xosd_push_batch(osd);
+  } else
+    seq = _xosd_push(osd, cmd, cmd, 1);
 
-  switch (osd->align) {
-  case XOSD_center:
-    x = (osd->screen_width - l->width) / 2;
-    break;
-  case XOSD_right:
-    x = osd->screen_width - l->width - x;
-  case XOSD_left:
-    break;
-  }
+  if (mode != POST_async)
+    _xosd_wait_seq(osd, seq);
+  FUNCTION_END(Dlocking);
+  return seq;
+}
 
-  if (osd->shadow_offset) {
-    XSetForeground(osd->display, osd->gc, osd->shadow_pixel);
-    _draw_text(osd, l->string, x + osd->shadow_offset,
-               y + osd->shadow_offset);
-  }
-  if (osd->outline_offset) {
-    int xd,yd;
-    XSetForeground(osd->display, osd->gc, osd->outline_pixel);
-    for (xd = -osd->outline_offset; xd <= osd->outline_offset; xd++)
-      for (yd = -osd->outline_offset; yd <= osd->outline_offset; yd++)
-        if (xd || yd)
-          _draw_text(osd, l->string, x + xd, y + yd);
-  }
-  if (1) {
-    XSetForeground(osd->display, osd->gc, osd->pixel);
-    _draw_text(osd, l->string, x, y);
+/* Take a command from the pool, allocate one only if the pool is empty.
+ * Takers are serialized by mutex_pool, so the next pointer read here cannot
+ * change through another take and give back in between (ABA); the event
+ * thread gives back without the lock. The text storage stays with the
+ * command. */
+static struct xosd_cmd *
+_xosd_cmd_new(xosd * osd, enum CMD type, int value, const char *name)
+{
+  struct xosd_cmd *cmd;
+
+  pthread_mutex_lock(&osd->mutex_pool);
+  do
+    cmd = osd->cmd_pool;
+  while (cmd
+         && !__sync_bool_compare_and_swap(&osd->cmd_pool, cmd, cmd->next));
+  pthread_mutex_unlock(&osd->mutex_pool);
+
+  if (cmd == NULL) {
+    cmd = calloc(1, sizeof(struct xosd_cmd));
+    if (cmd == NULL) {
+      xosd_error = "Out of memory";
+      return NULL;
+    }
   }
+  cmd->next = NULL;
+  cmd->seq = 0;
+  cmd->type = type;
+  cmd->value = value;
+  cmd->name = name;
+  memset(&cmd->line, 0, sizeof(cmd->line));
+  cmd->result = NULL;
+  cmd->borrowed = 0;
+  return cmd;
 }
 
-/* }}} */
-
-/* Handles X11 events, timeouts and does the drawing. {{{
- * This is running in it's own thread for Expose-events.
- * The order of update handling is important:
- * 1. The size must be correct -> UPD_size first
- * 2. Change the position, which might expose part of window -> UPD_pos
- * 3. The XShape must be set before something is drawn -> UPD_mask, UPD_lines
- * 4. The window should be mapped before something is drawn -> UPD_show
- * 5. Start the timer last to not account for processing time -> UPD_timer
- * If you change this order, you'll get a broken display. You've been warned!
- */
-static void *
-event_loop(void *osdv)
+/* Give the chain of commands from first to last back to the pool. */
+static void
+_xosd_cmd_put(xosd * osd, struct xosd_cmd *first, struct xosd_cmd *last)
 {
-  xosd *osd = osdv;
-  int xfd, max;
+  struct xosd_cmd *old;
 
-  FUNCTION_START(Dfunction);
-  DEBUG(Dtrace, "event thread started");
-  assert(osd);
+  do {
+    old = osd->cmd_pool;
+    last->next = old;
+  } while (!__sync_bool_compare_and_swap(&osd->cmd_pool, old, first));
+}
 
-  xfd = ConnectionNumber(osd->display);
-  max = (osd->pipefd[0] > xfd) ? osd->pipefd[0] : xfd;
+/* Free a chain of commands with their text storage. */
+static void
+_xosd_cmd_free(struct xosd_cmd *cmd)
+{
+  struct xosd_cmd *next;
 
-  pthread_mutex_lock(&osd->mutex);
-  DEBUG(Dtrace, "Request exposure events");
-  XSelectInput(osd->display, osd->window, ExposureMask);
-  osd->update |= UPD_size | UPD_pos | UPD_mask;
-  while (!osd->done) {
-    int retval, line;
-    fd_set readfds;
-    struct timeval tv, *tvp = NULL;
-
-    FD_ZERO(&readfds);
-    FD_SET(xfd, &readfds);
-    FD_SET(osd->pipefd[0], &readfds);
-
-    /* Hide display requested. */
-    if (osd->update & UPD_hide) {
-      DEBUG(Dupdate, "UPD_hide");
-      if (osd->generation & 1) {
-        XUnmapWindow(osd->display, osd->window);
-        osd->generation++;
-      }
-    }
-    /* The font, outline or shadow was changed. Recalculate line height,
-     * resize window and bitmaps. */
-    if (osd->update & UPD_size) {
-      XFontSetExtents *extents = XExtentsOfFontSet(osd->fontset);
-      DEBUG(Dupdate, "UPD_size");
-      osd->extent = &extents->max_logical_extent;
-      osd->line_height = osd->extent->height + osd->shadow_offset + 2 *
-        osd->outline_offset;
-      osd->height = osd->line_height * osd->number_lines;
-      for (line = 0; line < osd->number_lines; line++)
-        if (osd->lines[line].type == LINE_text)
-          osd->lines[line].text.width = -1;
-
-      XResizeWindow(osd->display, osd->window, osd->screen_width,
-                    osd->height);
-      XFreePixmap(osd->display, osd->mask_bitmap);
-      osd->mask_bitmap = XCreatePixmap(osd->display, osd->window,
-                                       osd->screen_width, osd->height, 1);
-      XFreePixmap(osd->display, osd->line_bitmap);
-      osd->line_bitmap = XCreatePixmap(osd->display, osd->window,
-                                       osd->screen_width, osd->height,
-                                       osd->depth);
-    }
-    /* H/V offset or vertical positon was changed. Horizontal alignment is
-     * handles internally as line realignment with UPD_content. */
-    if (osd->update & UPD_pos) {
-      int x = 0, y = 0;
-      DEBUG(Dupdate, "UPD_pos");
-      switch (osd->align) {
-      case XOSD_left:
-      case XOSD_center:
-        x = osd->screen_xpos + osd->hoffset;
-        break;
-      case XOSD_right:
-        x = osd->screen_xpos - osd->hoffset;
-      }
-      switch (osd->pos) {
-      case XOSD_bottom:
-        y = osd->screen_height - osd->height - osd->voffset;
-        break;
-      case XOSD_middle:
-        y = (osd->screen_height - osd->height) / 2 - osd->voffset;
-        break;
-      case XOSD_top:
-        y = osd->voffset;
-      }
-      XMoveWindow(osd->display, osd->window, x, y);
-    }
-    /* If the content changed, redraw lines in background buffer.
-     * Also update XShape unless only colours were changed. */
-    if (osd->update & (UPD_mask | UPD_lines)) {
-      DEBUG(Dupdate, "UPD_lines");
-      for (line = 0; line < osd->number_lines; line++) {
-        int y = osd->line_height * line;
-#ifdef DEBUG_XSHAPE
-        XSetForeground(osd->display, osd->gc, osd->outline_pixel);
-        XFillRectangle(osd->display, osd->line_bitmap, osd->gc, 0,
-                       y, osd->screen_width, osd->line_height);
-#endif
-        if (osd->update & UPD_mask) {
-          XFillRectangle(osd->display, osd->mask_bitmap, osd->mask_gc_back, 0,
-                         y, osd->screen_width, osd->line_height);
-        }
-        switch (osd->lines[line].type) {
-        case LINE_text:
-          draw_text(osd, line);
-          break;
-        case LINE_percentage:
-        case LINE_slider:
-          draw_bar(osd, line);
-        case LINE_blank:
-          break;
-        }
-      }
-    }
-#ifndef DEBUG_XSHAPE
-    /* More than colours was changed, also update XShape. */
-    if (osd->update & UPD_mask) {
-      DEBUG(Dupdate, "UPD_mask");
-      XShapeCombineMask(osd->display, osd->window, ShapeBounding, 0, 0,
-                        osd->mask_bitmap, ShapeSet);
-    }
-#endif
-    /* Show display requested. */
-    if (osd->update & UPD_show) {
-      DEBUG(Dupdate, "UPD_show");
-      if (~osd->generation & 1) {
-        osd->generation++;
-        XMapRaised(osd->display, osd->window);
-      }
-    }
-    /* Copy content, if window was changed or exposed. */
-    if ((osd->generation & 1)
-        && osd->update & (UPD_size | UPD_pos | UPD_lines | UPD_show)) {
-      DEBUG(Dupdate, "UPD_copy");
-      XCopyArea(osd->display, osd->line_bitmap, osd->window, osd->gc, 0, 0,
-                osd->screen_width, osd->height, 0, 0);
-    }
-    /* Flush all pennding X11 requests, if any. */
-    if (osd->update & ~UPD_timer) {
-      XFlush(osd->display);
-      osd->update &= UPD_timer;
-    }
-    /* Restart the timer when requested. */
-    if (osd->update & UPD_timer) {
-      DEBUG(Dupdate, "UPD_timer");
-      osd->update = UPD_none;
-      if ((osd->generation & 1) && (osd->timeout > 0))
-        gettimeofday(&osd->timeout_start, NULL);
-      else
-        timerclear(&osd->timeout_start);
-    }
-    /* Calculate timeout delta or hide display. */
-    if (timerisset(&osd->timeout_start)) {
-      gettimeofday(&tv, NULL);
-      tv.tv_sec -= osd->timeout;
-      if (timercmp(&tv, &osd->timeout_start, <)) {
-        tv.tv_sec = osd->timeout_start.tv_sec - tv.tv_sec;
-        tv.tv_usec = osd->timeout_start.tv_usec - tv.tv_usec;
-        if (tv.tv_usec < 0) {
-          tv.tv_usec += 1000000;
-          tv.tv_sec -= 1;
-        }
-        tvp = &tv;
-      } else {
-        timerclear(&osd->timeout_start);
-        if (osd->generation & 1)
-          osd->update |= UPD_hide;
-        continue;               /* Hide the window first and than restart the loop */
-      }
-    }
+  for (; cmd; cmd = next) {
+    next = cmd->next;
+    free(cmd->text);
+    free(cmd);
+  }
+}
 
-    /* Signal update */
-    pthread_mutex_lock(&osd->mutex_sync);
-    pthread_cond_broadcast(&osd->cond_sync);
-    pthread_mutex_unlock(&osd->mutex_sync);
+/* Return storage for size bytes of text in cmd, NULL if out of memory. */
+static char *
+_xosd_cmd_text(struct xosd_cmd *cmd, size_t size)
+{
+  char *text;
+
+  if (size <= sizeof(cmd->inline_text))
+    return cmd->inline_text;
+  if (size > cmd->text_size) {
+    text = realloc(cmd->text, size);
+    if (text == NULL)
+      return NULL;
+    cmd->text = text;
+    cmd->text_size = size;
+  }
+  return cmd->text;
+}
 
-    /* Wait for the next X11 event or an API request via the pipe. */
-    retval = select(max + 1, &readfds, NULL, NULL, tvp);
-    DEBUG(Dvalue, "SELECT=%d PIPE=%d X11=%d", retval,
-          FD_ISSET(osd->pipefd[0], &readfds), FD_ISSET(xfd, &readfds));
+/* Return whether a show just waited for failed, because the default font
+ * could not be loaded. Without waiting the flag may be stale. */
+static int
+_xosd_show_failed(xosd * osd)
+{
+  if (osd->async || _xosd_in_batch(osd) || !osd->no_font)
+    return 0;
+  xosd_error = "Default font not found";
+  return 1;
+}
 
-    if (retval == -1 && errno == EINTR) {
-      DEBUG(Dselect, "select() EINTR");
-      continue;
-    } else if (retval == -1) {
-      DEBUG(Dselect, "select() error %d", errno);
-      osd->done = 1;
-      break;
-    } else if (retval == 0) {
-      DEBUG(Dselect, "select() timeout");
-      continue;                 /* timeout */
-    } else if (FD_ISSET(osd->pipefd[0], &readfds)) {
-      /* Another thread wants to use the X11 connection */
-      pthread_cond_wait(&osd->cond_wait, &osd->mutex);
-      DEBUG(Dselect, "Resume exposure thread after X11 call");
-      continue;
-    } else if (FD_ISSET(xfd, &readfds)) {
-      XEvent report;
-      /* There is a event, but it might not be an Exposure-event, so don't use
-       * XWindowEvent(), since that might block. */
-      XNextEvent(osd->display, &report);
-      /* ignore sent by server/manual send flag */
-      switch (report.type & 0x7f) {
-      case Expose:
-        {
-          XExposeEvent *XE = &report.xexpose;
-          /* http://x.holovko.ru/Xlib/chap10.html#10.9.1 */
-          DEBUG(Dvalue, "expose %d: x=%d y=%d w=%d h=%d", XE->count,
-                XE->x, XE->y, XE->width, XE->height);
-#if 0
-          if (report.xexpose.count == 0) {
-            int ytop, ybot;
-            ytop = report.xexpose.y / osd->line_height;
-            ybot =
-              (report.xexpose.y + report.xexpose.height) / osd->line_height;
-            do {
-              osd->lines[ytop].width = -1;
-            } while (ytop++ < ybot);
-          }
-#endif
-          XCopyArea(osd->display, osd->line_bitmap, osd->window, osd->gc,
-                    report.xexpose.x, report.xexpose.y, report.xexpose.width,
-                    report.xexpose.height, report.xexpose.x, report.xexpose.y);
-          break;
-        }
-      case GraphicsExpose:
-        {
-          XGraphicsExposeEvent *XE = &report.xgraphicsexpose;
-          DEBUG(Dvalue, "gfxexpose %d: x=%d y=%d w=%d h=%d code=%d",
-                XE->count, XE->x, XE->y, XE->width, XE->height, XE->major_code);
-          break;
-        }
-      case NoExpose:
-        {
-          XNoExposeEvent *XE = &report.xnoexpose;
-          DEBUG(Dvalue, "noexpose: code=%d", XE->major_code);
-          break;
-        }
-      default:
-        DEBUG(Dvalue, "XEvent=%d", report.type);
-        break;
-      }
-      continue;
-    } else {
-      DEBUG(Dselect, "select() FATAL %d", retval);
-      exit(-1);                 /* Impossible */
-    }
-  }
-  pthread_mutex_unlock(&osd->mutex);
+/* Post a simple command and return its result. */
+static int
+_xosd_call(xosd * osd, enum CMD type, int value, const char *name,
+           enum POST mode)
+{
+  int ret = 0;
+  struct xosd_cmd *cmd = _xosd_cmd_new(osd, type, value, name);
 
-  return NULL;
+  if (cmd == NULL)
+    return -1;
+  if (mode == POST_sync)
+    cmd->result = &ret;
+  _xosd_post(osd, cmd, mode);
+  return ret;
 }
 
 /* }}} */
 
-/* Parse textual colour value. {{{ */
-static int
-parse_colour(xosd * osd, XColor * col, unsigned long *pixel,
-             const char *colour)
+/* Colour cache. {{{
+ * Parsed and allocated colours are kept per context until it is destroyed,
+ * so setting a colour again needs no round trip. On TrueColor visuals the
+ * pixel is computed from the visual masks instead of asking the server.
+ * API threads look up known colours as well, so changing to one of them
+ * does not wait for the event-thread. */
+/* Scale a 16 bit colour value to the mask of a TrueColor visual. */
+static unsigned long
+_truecolor_channel(unsigned long mask, int value)
+{
+  int shift, bits;
+
+  for (shift = 0; mask && !(mask & 1); mask >>= 1)
+    shift++;
+  for (bits = 0; mask & 1; mask >>= 1)
+    bits++;
+  return (unsigned long) (value >> (16 - bits)) << shift;
+}
+static unsigned long
+_truecolor_pixel(Visual * visual, int red, int green, int blue)
+{
+  return _truecolor_channel(visual->red_mask, red) |
+    _truecolor_channel(visual->green_mask, green) |
+    _truecolor_channel(visual->blue_mask, blue);
+}
+/* Return the cached colour called name, or NULL. */
+static struct xosd_colour *
+colour_lookup(xosd_context * ctx, const char *name)
+{
+  struct xosd_colour *c;
+
+  pthread_mutex_lock(&ctx->mutex_sync);
+  for (c = ctx->colours; c; c = c->next)
+    if (strcmp(c->name, name) == 0)
+      break;
+  pthread_mutex_unlock(&ctx->mutex_sync);
+  return c;
+}
+/* Parse and allocate colour into c. */
+static void
+colour_alloc(xosd * osd, const char *colour, struct xosd_colour *c)
 {
   Colormap colourmap;
-  int retval = 0;
 
   FUNCTION_START(Dfunction);
   DEBUG(Dtrace, "getting colourmap");
   colourmap = DefaultColormap(osd->display, osd->screen);
 
+  c->ok = 0;
   DEBUG(Dtrace, "parsing colour");
-  if (XParseColor(osd->display, colourmap, colour, col)) {
+  if (!XParseColor(osd->display, colourmap, colour, &c->colour)) {
+    DEBUG(Dtrace, "could not poarse colour. defaulting to white");
+  } else if (osd->visual->class == TrueColor) {
+    c->colour.pixel = _truecolor_pixel(osd->visual, c->colour.red,
+                                       c->colour.green, c->colour.blue);
+    c->ok = 1;
+  } else {
     DEBUG(Dtrace, "attempting to allocate colour");
-    if (XAllocColor(osd->display, colourmap, col)) {
+    if (XAllocColor(osd->display, colourmap, &c->colour)) {
       DEBUG(Dtrace, "allocation sucessful");
-      *pixel = col->pixel;
-    } else {
+      c->ok = 1;
+    } else
       DEBUG(Dtrace, "defaulting to white. could not allocate colour");
-      *pixel = WhitePixel(osd->display, osd->screen);
-      retval = -1;
+  }
+}
+/* Parse textual colour value. */
+static int
+parse_colour(xosd * osd, XColor * col, unsigned long *pixel,
+             const char *colour)
+{
+  xosd_context *ctx = osd->context;
+  struct xosd_colour *c, tmp;
+
+  FUNCTION_START(Dfunction);
+  c = colour_lookup(ctx, colour);
+  if (c == NULL) {
+    c = malloc(sizeof(struct xosd_colour));
+    if (c == NULL || (c->name = strdup(colour)) == NULL) {
+      free(c);
+      c = &tmp;
+    }
+    colour_alloc(osd, colour, c);
+    if (c != &tmp) {
+      pthread_mutex_lock(&ctx->mutex_sync);
+      c->next = ctx->colours;
+      ctx->colours = c;
+      pthread_mutex_unlock(&ctx->mutex_sync);
     }
-  } else {
-    DEBUG(Dtrace, "could not poarse colour. defaulting to white");
-    *pixel = WhitePixel(osd->display, osd->screen);
-    retval = -1;
   }
 
-  return retval;
+  if (!c->ok) {
+    *pixel = WhitePixel(osd->display, osd->screen);
+    return -1;
+  }
+  *col = c->colour;
+  *pixel = c->colour.pixel;
+  return 0;
+}
+/* Remember the colour set by the API for xosd_get_colour(), which returns
+ * it even before the event-thread applied it. */
+static void
+_xosd_set_colour_seen(xosd * osd, enum CMD type, struct xosd_colour *c)
+{
+  if (type != CMD_colour || c == NULL || !c->ok)
+    return;
+  pthread_mutex_lock(&osd->context->mutex_sync);
+  osd->set_colour = c->colour;
+  pthread_mutex_unlock(&osd->context->mutex_sync);
+}
+/* Change a colour from an API thread. */
+static int
+_xosd_set_colour(xosd * osd, enum CMD type, const char *colour)
+{
+  struct xosd_colour *c = colour_lookup(osd->context, colour);
+  int ret;
+
+  /* Only the first use of a colour waits for it to be parsed, which also
+   * caches it. The name of a cached colour lives as long as the context. */
+  if (c == NULL) {
+    ret = _xosd_call(osd, type, 0, colour, POST_sync);
+    _xosd_set_colour_seen(osd, type, colour_lookup(osd->context, colour));
+    return ret;
+  }
+  _xosd_set_colour_seen(osd, type, c);
+  if (_xosd_call(osd, type, 0, c->name, POST_async) == -1)
+    return -1;
+  return c->ok ? 0 : -1;
 }
 
 /* }}} */
 
-/* Tell window manager to put window topmost. {{{ */
-void
-stay_on_top(Display * dpy, Window win)
+#ifdef HAVE_XFT
+/* Client-side rasterizer. {{{
+ * With XOSD_RENDER=image text, bars and effects are drawn into line_image
+ * and mask_image on the client. update_display() then uploads the rows of
+ * all dirty lines with one XShmPutImage() (or XPutImage() without MIT-SHM)
+ * and one XPutImage() for the mask, instead of many small requests.
+ * A ShmCompletion event tells when the server has read the shared image, so
+ * it is only waited for before the image is changed again.
+ * Glyphs come from the FreeType face of the Xft font. */
+#ifdef USE_XSHM
+static int _xosd_shm_failed;
+/* XShmAttach() fails asynchronously for remote displays. The handler is
+ * only installed for the XSync() after it. */
+static int
+_xosd_shm_error(Display * dpy, XErrorEvent * event)
+{
+  _xosd_shm_failed = 1;
+  return 0;
+}
+static Bool
+_image_put_done(Display * display, XEvent * event, XPointer arg)
+{
+  xosd *osd = (xosd *) arg;
+  return event->type == osd->shm_completion
+    && ((XShmCompletionEvent *) event)->drawable == osd->shm_busy;
+}
+#endif
+/* Wait until the server has read line_image, before it is changed. */
+static void
+image_wait(xosd * osd)
+{
+#ifdef USE_XSHM
+  XEvent event;
+
+  if (osd->shm_busy == None)
+    return;
+  XIfEvent(osd->display, &event, _image_put_done, (XPointer) osd);
+  osd->shm_busy = None;
+#endif
+}
+static void
+image_free(xosd * osd)
+{
+  FUNCTION_START(Dfunction);
+  image_wait(osd);
+  if (osd->line_image) {
+#ifdef USE_XSHM
+    if (osd->shminfo.shmaddr) {
+      XShmDetach(osd->display, &osd->shminfo);
+      shmdt(osd->shminfo.shmaddr);
+      osd->shminfo.shmaddr = NULL;
+      osd->line_image->data = NULL;
+    }
+#endif
+    XDestroyImage(osd->line_image);
+    osd->line_image = NULL;
+  }
+  if (osd->mask_image) {
+    XDestroyImage(osd->mask_image);
+    osd->mask_image = NULL;
+  }
+  free(osd->coverage);
+  osd->coverage = NULL;
+  free(osd->spread);
+  osd->spread = NULL;
+}
+#ifdef USE_XSHM
+static XImage *
+_image_create_shm(xosd * osd)
+{
+  XImage *image;
+  XErrorHandler handler;
+
+  image = XShmCreateImage(osd->display, osd->visual, osd->depth, ZPixmap,
+                          NULL, &osd->shminfo, osd->width,
+                          osd->height);
+  if (image == NULL)
+    return NULL;
+  osd->shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line *
+                              image->height, IPC_CREAT | 0600);
+  if (osd->shminfo.shmid == -1)
+    goto error0;
+  osd->shminfo.shmaddr = shmat(osd->shminfo.shmid, NULL, 0);
+  /* Removed now, so it vanishes once both sides detached. */
+  shmctl(osd->shminfo.shmid, IPC_RMID, NULL);
+  if (osd->shminfo.shmaddr == (char *) -1)
+    goto error0;
+  osd->shminfo.readOnly = False;
+  image->data = osd->shminfo.shmaddr;
+
+  _xosd_shm_failed = 0;
+  handler = XSetErrorHandler(_xosd_shm_error);
+  XShmAttach(osd->display, &osd->shminfo);
+  XSync(osd->display, False);
+  XSetErrorHandler(handler);
+  if (_xosd_shm_failed) {
+    shmdt(osd->shminfo.shmaddr);
+    goto error0;
+  }
+  return image;
+
+error0:
+  osd->shminfo.shmaddr = NULL;
+  image->data = NULL;
+  XDestroyImage(image);
+  return NULL;
+}
+#endif
+/* (Re)create the client images for the current window size. */
+static int
+image_create(xosd * osd)
+{
+  int lsize = osd->width * osd->line_height;
+
+  FUNCTION_START(Dfunction);
+  image_free(osd);
+#ifdef USE_XSHM
+  if (osd->shm && (osd->line_image = _image_create_shm(osd)) == NULL) {
+    DEBUG(Dtrace, "MIT-SHM not usable, falling back to XPutImage");
+    osd->shm = 0;
+  }
+  if (osd->line_image == NULL)
+#endif
+  {
+    osd->line_image = XCreateImage(osd->display, osd->visual, osd->depth,
+                                   ZPixmap, 0, NULL, osd->width,
+                                   osd->height, 32, 0);
+    if (osd->line_image == NULL)
+      goto error;
+    osd->line_image->data = malloc(osd->line_image->bytes_per_line *
+                                   osd->height);
+    if (osd->line_image->data == NULL)
+      goto error;
+  }
+  osd->mask_image = XCreateImage(osd->display, osd->visual, 1, XYBitmap, 0,
+                                 NULL, osd->width, osd->height, 8, 0);
+  if (osd->mask_image == NULL)
+    goto error;
+  osd->mask_image->data = calloc(osd->mask_image->bytes_per_line,
+                                 osd->height);
+  osd->coverage = malloc(lsize);
+  osd->spread = malloc(lsize);
+  if (osd->mask_image->data == NULL || !osd->coverage || !osd->spread)
+    goto error;
+  return 0;
+
+error:
+  image_free(osd);
+  return -1;
+}
+/* Draw through Xft instead when the client images cannot be created. */
+static void
+image_fallback(xosd * osd)
+{
+  int line;
+
+  FUNCTION_START(Dfunction);
+  DEBUG(Dtrace, "client images not usable, falling back to Xft");
+  image_free(osd);
+  osd->image = 0;
+#ifdef USE_XSHM
+  osd->shm = 0;
+#endif
+  osd->cache_size = XOSD_CACHE_SIZE;
+  osd->xft_line = XftDrawCreate(osd->display, osd->line_bitmap, osd->visual,
+                                DefaultColormap(osd->display, osd->screen));
+  osd->xft_glyph = XftDrawCreateBitmap(osd->display, osd->glyph_bitmap);
+  for (line = 0; line < osd->number_lines; line++)
+    if (osd->lines[line].type == LINE_percentage
+        || osd->lines[line].type == LINE_slider)
+      osd->lines[line].bar.drawn = -1;
+  DIRTY_ALL(osd);
+  osd->update |= UPD_content;
+}
+/* Clear the XShape mask of one line. */
+static void
+image_clear_mask(xosd * osd, int line)
+{
+  XImage *m = osd->mask_image;
+  memset(m->data + m->bytes_per_line * osd->line_height * line, 0,
+         m->bytes_per_line * osd->line_height);
+}
+static /*inline */ void
+_image_put(xosd * osd, int x, int y, unsigned long pixel)
+{
+  XPutPixel(osd->line_image, x, y, pixel);
+  XPutPixel(osd->mask_image, x, y, 1);
+}
+/* Fill a rectangle like XFillRectangle() does for both bitmaps. */
+static void
+image_fill(xosd * osd, XRectangle * r, unsigned long pixel)
+{
+  int x, y, x0 = r->x, y0 = r->y, x1 = r->x + r->width, y1 = r->y + r->height;
+
+  if (x0 < 0)
+    x0 = 0;
+  if (y0 < 0)
+    y0 = 0;
+  if (x1 > osd->width)
+    x1 = osd->width;
+  if (y1 > osd->height)
+    y1 = osd->height;
+  for (y = y0; y < y1; y++)
+    for (x = x0; x < x1; x++)
+      _image_put(osd, x, y, pixel);
+}
+/* Clear a rectangle of the XShape mask. */
+static void
+image_clear(xosd * osd, XRectangle * r)
+{
+  int x, y;
+
+  for (y = r->y; y < r->y + r->height && y < osd->height; y++)
+    for (x = r->x; x < r->x + r->width && x < osd->width; x++)
+      XPutPixel(osd->mask_image, x, y, 0);
+}
+/* Mix two colours for anti-aliased edges, only on TrueColor visuals. */
+static unsigned long
+_image_mix(xosd * osd, XColor * fg, XColor * bg, int alpha)
+{
+  int red = (fg->red * alpha + bg->red * (255 - alpha)) / 255;
+  int green = (fg->green * alpha + bg->green * (255 - alpha)) / 255;
+  int blue = (fg->blue * alpha + bg->blue * (255 - alpha)) / 255;
+
+  return _truecolor_pixel(osd->visual, red, green, blue);
+}
+/* Or the pixels of the bitmap into coverage at x, y. */
+static void
+_image_glyph(xosd * osd, FT_Bitmap * b, int x, int y)
+{
+  int gx, gy, a;
+
+  for (gy = 0; gy < (int) b->rows; gy++) {
+    unsigned char *src, *dst;
+    if (y + gy < 0 || y + gy >= osd->line_height)
+      continue;
+    src = b->buffer + gy * b->pitch;
+    dst = osd->coverage + (y + gy) * osd->width;
+    for (gx = 0; gx < (int) b->width; gx++) {
+      if (x + gx < 0 || x + gx >= osd->width)
+        continue;
+      if (b->pixel_mode == FT_PIXEL_MODE_MONO)
+        a = (src[gx >> 3] & (0x80 >> (gx & 7))) ? 255 : 0;
+      else
+        a = src[gx];
+      if (a > dst[x + gx])
+        dst[x + gx] = a;
+    }
+  }
+}
+/* Grow spread by radius pixels along one axis, like _dilate_bitmap(). */
+static void
+_image_dilate(xosd * osd, int radius, int vertical)
+{
+  int c, d, i, j, w = osd->width, h = osd->line_height;
+  unsigned char *p = osd->spread;
+
+  for (c = 0; c < radius; c += d) {
+    d = (2 * c + 1 < radius - c) ? 2 * c + 1 : radius - c;
+    if (vertical) {
+      for (j = h - 1; j >= d; j--)
+        for (i = 0; i < w; i++)
+          p[j * w + i] |= p[(j - d) * w + i];
+      for (j = 0; j < h - d; j++)
+        for (i = 0; i < w; i++)
+          p[j * w + i] |= p[(j + d) * w + i];
+    } else {
+      for (j = 0; j < h; j++, p += w) {
+        for (i = w - 1; i >= d; i--)
+          p[i] |= p[i - d];
+        for (i = 0; i < w - d; i++)
+          p[i] |= p[i + d];
+      }
+      p = osd->spread;
+    }
+  }
+}
+/* Rasterize text with shadow and outline into line y at x. */
+static void
+image_draw_text(xosd * osd, FcChar32 * ucs, int len, int x, int y)
+{
+  int w = osd->width, h = osd->line_height;
+  int d = osd->shadow_offset, blend = osd->visual->class == TrueColor;
+  int i, px, py;
+  FT_Face face;
+
+  FUNCTION_START(Dfunction);
+  face = XftLockFace(osd->xftfont);
+  if (face == NULL)
+    return;
+  memset(osd->coverage, 0, w * h);
+  for (i = 0; i < len; i++) {
+    if (FT_Load_Char(face, ucs[i], FT_LOAD_RENDER))
+      continue;
+    _image_glyph(osd, &face->glyph->bitmap, x + face->glyph->bitmap_left,
+                 osd->outline_offset - osd->extent.y -
+                 face->glyph->bitmap_top);
+    x += (face->glyph->advance.x + 32) >> 6;
+  }
+  XftUnlockFace(osd->xftfont);
+
+  if (osd->outline_offset) {
+    for (i = 0; i < w * h; i++)
+      osd->spread[i] = osd->coverage[i] >= 0x80;
+    _image_dilate(osd, osd->outline_offset, 0);
+    _image_dilate(osd, osd->outline_offset, 1);
+  }
+
+  /* Shadow, outline and text are painted over each other in this order; the
+   * anti-aliased edge of the text is mixed with what is below it. */
+  for (py = 0; py < h; py++) {
+    for (px = 0; px < w; px++) {
+      int a = osd->coverage[py * w + px];
+      int shadow = d && px >= d && py >= d
+        && osd->coverage[(py - d) * w + px - d] >= 0x80;
+      int outline = osd->outline_offset && osd->spread[py * w + px];
+      XColor *below = outline ? &osd->outline_colour :
+        shadow ? &osd->shadow_colour : NULL;
+
+      if (a && below && blend)
+        _image_put(osd, px, y + py, _image_mix(osd, &osd->colour, below, a));
+      else if (a >= 0x80)
+        _image_put(osd, px, y + py, osd->pixel);
+      else if (outline)
+        _image_put(osd, px, y + py, osd->outline_pixel);
+      else if (shadow)
+        _image_put(osd, px, y + py, osd->shadow_pixel);
+    }
+  }
+}
+/* Upload the rows of all dirty lines. */
+static void
+image_upload(xosd * osd)
+{
+  int line, first = -1, last = -1, y, height;
+
+  FUNCTION_START(Dfunction);
+  for (line = 0; line < osd->number_lines; line++)
+    if (DIRTY_ISSET(osd, line)) {
+      if (first < 0)
+        first = line;
+      last = line;
+    }
+  if (first < 0)
+    return;
+  y = osd->line_height * first;
+  height = osd->line_height * (last - first + 1);
+
+#ifdef USE_XSHM
+  if (osd->shm) {
+    XShmPutImage(osd->display, osd->line_bitmap, osd->gc, osd->line_image,
+                 0, y, 0, y, osd->width, height, True);
+    osd->shm_busy = osd->line_bitmap;
+  } else
+#endif
+    XPutImage(osd->display, osd->line_bitmap, osd->gc, osd->line_image, 0, y,
+              0, y, osd->width, height);
+  osd->stats.image_bytes += osd->line_image->bytes_per_line * height;
+  if (osd->update & UPD_mask) {
+    XPutImage(osd->display, osd->mask_bitmap, osd->mask_gc, osd->mask_image,
+              0, y, 0, y, osd->width, height);
+    osd->stats.image_bytes += osd->mask_image->bytes_per_line * height;
+  }
+}
+
+/* }}} */
+#endif
+
+/* Return the x of content width pixels wide within the window. */
+static int
+_align_x(xosd * osd, int width)
+{
+  switch (osd->align) {
+  case XOSD_center:
+    return (osd->width - width) / 2;
+  case XOSD_right:
+    return osd->width - width - XOFFSET;
+  case XOSD_left:
+  default:
+    return XOFFSET;
+  }
+}
+
+/* Draw percentage/slider bar. {{{
+ * Each of the outline, shadow and bar passes is sent as one XFillRectangles()
+ * per bitmap. If the bar is already on screen and only its value changed,
+ * just the cells of the segments which flipped are cleared and redrawn; all
+ * rectangles are clipped to those cells, so overlapping outlines of their
+ * neighbours stay intact. */
+static int
+_intersect(const XRectangle * a, const XRectangle * b, XRectangle * r)
+{
+  int x0 = (a->x > b->x) ? a->x : b->x;
+  int y0 = (a->y > b->y) ? a->y : b->y;
+  int x1 = (a->x + a->width < b->x + b->width) ?
+    a->x + a->width : b->x + b->width;
+  int y1 = (a->y + a->height < b->y + b->height) ?
+    a->y + a->height : b->y + b->height;
+
+  if (x1 <= x0 || y1 <= y0)
+    return 0;
+  r->x = x0;
+  r->y = y0;
+  r->width = x1 - x0;
+  r->height = y1 - y0;
+  return 1;
+}
+/* Set the size of one segment in p and return the number of segments. */
+static int
+_bar_segments(xosd * osd, XRectangle * p)
+{
+  p->width = -osd->extent.y / 2;
+  p->height = -osd->extent.y;
+  /* Calculate number of bars in automatic mode */
+  if (osd->bar_length == -1)
+    return (osd->screen_width * SLIDER_SCALE) / p->width;
+  return osd->bar_length;
+}
+static void                     /*inline */
+_draw_bar(xosd * osd, int nbars, int on, XRectangle * p, XRectangle * mod,
+          int is_slider, unsigned long pixel, XRectangle * clip, int nclip)
+{
+  int i, c, n = 0;
+  XRectangle rs[2];
+  FUNCTION_START(Dfunction);
+
+  rs[0].x = rs[1].x = mod->x + p->x;
+  rs[0].y = (rs[1].y = mod->y + p->y) + p->height / 3;
+  rs[0].width = mod->width + p->width * SLIDER_SCALE;
+  rs[0].height = mod->height + p->height / 3;
+  rs[1].width = mod->width + p->width * SLIDER_SCALE_ON;
+  rs[1].height = mod->height + p->height;
+  for (i = 0; i < nbars; i++, rs[0].x = rs[1].x += p->width) {
+    XRectangle *r = &(rs[is_slider ? (i == on) : (i < on)]);
+    if (nclip == 0)
+      osd->bar_rects[n++] = *r;
+    for (c = 0; c < nclip; c++)
+      n += _intersect(r, &clip[c], &osd->bar_rects[n]);
+  }
+  if (n == 0)
+    return;
+#ifdef HAVE_XFT
+  if (osd->image) {
+    for (i = 0; i < n; i++)
+      image_fill(osd, &osd->bar_rects[i], pixel);
+    return;
+  }
+#endif
+  XSetForeground(osd->display, osd->gc, pixel);
+  XFillRectangles(osd->display, osd->mask_bitmap, osd->mask_gc,
+                  osd->bar_rects, n);
+  XFillRectangles(osd->display, osd->line_bitmap, osd->gc, osd->bar_rects, n);
+  FUNCTION_END(Dfunction);
+}
+/* Set clip to the cell covering segment i including outline and shadow. */
+static void
+_bar_cell(xosd * osd, XRectangle * p, int i, int line, XRectangle * clip)
+{
+  clip->x = p->x + i * p->width - osd->outline_offset;
+  clip->y = osd->line_height * line;
+  clip->width = p->width * SLIDER_SCALE + 2 * osd->outline_offset +
+    osd->shadow_offset;
+  clip->height = osd->line_height;
+}
+static void
+draw_bar(xosd * osd, int line)
+{
+  struct xosd_bar *l = &LINE(osd, line)->bar;
+  int is_slider = l->type == LINE_slider, nbars, on, nclip = 0;
+  XRectangle p, m, clip[2];
+
+  assert(osd);
+  FUNCTION_START(Dfunction);
+
+  nbars = _bar_segments(osd, &p);
+  p.x = _align_x(osd, nbars * p.width);
+  p.y = osd->line_height * line + osd->outline_offset;
+  on = ((nbars - is_slider) * l->value) / 100;
+
+  DEBUG(Dvalue, "percent=%d, nbars=%d, on=%d, drawn=%d", l->value, nbars,
+        on, l->drawn);
+
+  if (nbars > osd->bar_rects_size) {
+    XRectangle *rects = realloc(osd->bar_rects, 2 * nbars * sizeof(XRectangle));
+    if (rects == NULL)
+      return;
+    osd->bar_rects = rects;
+    osd->bar_rects_size = nbars;
+  }
+
+  /* Only redraw the cells of the segments which flipped. */
+  if (l->drawn >= 0) {
+    if (l->drawn == on)
+      return;
+    if (is_slider) {
+      _bar_cell(osd, &p, l->drawn, line, &clip[nclip++]);
+      _bar_cell(osd, &p, on, line, &clip[nclip++]);
+    } else {
+      _bar_cell(osd, &p, (on < l->drawn) ? on : l->drawn, line, &clip[0]);
+      clip[0].width += (abs(on - l->drawn) - 1) * p.width;
+      nclip = 1;
+    }
+#ifdef HAVE_XFT
+    if (osd->image) {
+      int i;
+      for (i = 0; i < nclip; i++)
+        image_clear(osd, &clip[i]);
+    } else
+#endif
+      XFillRectangles(osd->display, osd->mask_bitmap, osd->mask_gc_back,
+                      clip, nclip);
+  }
+  l->drawn = on;
+
+  /* Outline */
+  if (osd->outline_offset) {
+    m.x = m.y = -osd->outline_offset;
+    m.width = m.height = 2 * osd->outline_offset;
+    _draw_bar(osd, nbars, on, &p, &m, is_slider, osd->outline_pixel, clip,
+              nclip);
+  }
+  /* Shadow */
+  if (osd->shadow_offset) {
+    m.x = m.y = osd->shadow_offset;
+    m.width = m.height = 0;
+    _draw_bar(osd, nbars, on, &p, &m, is_slider, osd->shadow_pixel, clip,
+              nclip);
+  }
+  /* Bar/Slider */
+  if (1) {
+    m.x = m.y = m.width = m.height = 0;
+    _draw_bar(osd, nbars, on, &p, &m, is_slider, osd->pixel, clip, nclip);
+  }
+}
+
+/* }}} */
+
+/* Cache of rendered text lines. {{{
+ * Most displays cycle through a few strings, so draw_text() keeps recently
+ * drawn lines as a pixmap and mask pair. A hit is one copy into line_bitmap
+ * and one into mask_bitmap. The least recently used entries are dropped to
+ * keep the estimated server memory within osd->cache_size, or to make room
+ * when all entries of the pool are in use. */
+static unsigned long
+_xosd_hash(const char *string)
+{
+  unsigned long hash = 5381;
+  while (*string)
+    hash = hash * 33 + (unsigned char) *string++;
+  return hash;
+}
+static void
+_cache_unlink(xosd * osd, struct xosd_cache *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    osd->cache = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    osd->cache_last = e->prev;
+}
+static void
+_cache_free(xosd * osd, struct xosd_cache *e)
+{
+  _cache_unlink(osd, e);
+  osd->stats.cache_entries--;
+  osd->stats.cache_bytes -= e->bytes;
+  XFreePixmap(osd->display, e->pixmap);
+  XFreePixmap(osd->display, e->mask);
+  e->next = osd->cache_free;
+  osd->cache_free = e;
+}
+/* Drop least recently used entries until at most size bytes are used. */
+static void
+cache_trim(xosd * osd, unsigned long size)
+{
+  FUNCTION_START(Dfunction);
+  while (osd->cache_last && osd->stats.cache_bytes > size) {
+    _cache_free(osd, osd->cache_last);
+    osd->stats.cache_evictions++;
+  }
+}
+static struct xosd_cache *
+cache_lookup(xosd * osd, const char *string, unsigned long hash)
+{
+  struct xosd_cache *e;
+
+  FUNCTION_START(Dfunction);
+  for (e = osd->cache; e; e = e->next) {
+    if (e->hash == hash && e->pixel == osd->pixel
+        && e->shadow_pixel == osd->shadow_pixel
+        && e->outline_pixel == osd->outline_pixel
+        && strcmp(e->string, string) == 0) {
+      if (e != osd->cache) {
+        _cache_unlink(osd, e);
+        e->prev = NULL;
+        e->next = osd->cache;
+        osd->cache->prev = e;
+        osd->cache = e;
+      }
+      osd->stats.cache_hits++;
+      return e;
+    }
+  }
+  osd->stats.cache_misses++;
+  return NULL;
+}
+/* Copy the just drawn line at y from x+dx to x+dx+width into a new entry.
+ * Text clipped by the window is not cached, because it might be shown
+ * completely after the window grows. */
+static void
+cache_add(xosd * osd, const char *string, unsigned long hash, int x, int dx,
+          int y, int width)
+{
+  struct xosd_cache *e;
+  int bpp = (osd->depth > 16) ? 4 : (osd->depth > 8) ? 2 : 1;
+  unsigned long bytes;
+
+  FUNCTION_START(Dfunction);
+  if (x + dx < 0 || x + dx + width > osd->width || width <= 0)
+    return;
+  if (strlen(string) >= XOSD_CACHE_KEY)
+    return;
+  bytes = (unsigned long) osd->line_height * (width * bpp + (width + 7) / 8);
+  if (bytes > osd->cache_size)
+    return;
+  cache_trim(osd, osd->cache_size - bytes);
+
+  if (osd->cache_pool == NULL) {
+    int i;
+    osd->cache_pool = calloc(XOSD_CACHE_ENTRIES, sizeof(struct xosd_cache));
+    if (osd->cache_pool == NULL)
+      return;
+    for (i = 0; i < XOSD_CACHE_ENTRIES; i++) {
+      osd->cache_pool[i].next = osd->cache_free;
+      osd->cache_free = &osd->cache_pool[i];
+    }
+  }
+  if (osd->cache_free == NULL) {
+    _cache_free(osd, osd->cache_last);
+    osd->stats.cache_evictions++;
+  }
+  e = osd->cache_free;
+  osd->cache_free = e->next;
+  strcpy(e->string, string);
+  e->hash = hash;
+  e->pixel = osd->pixel;
+  e->shadow_pixel = osd->shadow_pixel;
+  e->outline_pixel = osd->outline_pixel;
+  e->dx = dx;
+  e->width = width;
+  e->bytes = bytes;
+  e->pixmap = XCreatePixmap(osd->display, osd->window, width,
+                            osd->line_height, osd->depth);
+  XCopyArea(osd->display, osd->line_bitmap, e->pixmap, osd->gc, x + dx, y,
+            width, osd->line_height, 0, 0);
+  e->mask = XCreatePixmap(osd->display, osd->window, width, osd->line_height,
+                          1);
+  XCopyArea(osd->display, osd->mask_bitmap, e->mask, osd->mask_gc, x + dx,
+            y, width, osd->line_height, 0, 0);
+
+  e->prev = NULL;
+  e->next = osd->cache;
+  if (osd->cache)
+    osd->cache->prev = e;
+  else
+    osd->cache_last = e;
+  osd->cache = e;
+  osd->stats.cache_entries++;
+  osd->stats.cache_bytes += bytes;
+}
+
+/* }}} */
+
+/* Draw text. {{{
+ * The glyphs are rasterized only once into the 1-bit glyph_bitmap. The outline
+ * is derived from it by dilation into outline_bitmap and the shadow is just
+ * the glyph bitmap at an offset. Each bitmap is then used as clip-mask to fill
+ * its colour into the line and is or-ed into the XShape mask. */
+static void                     /*inline */
+_paint_bitmap(xosd * osd, Pixmap bitmap, unsigned long pixel, int y, int d)
+{
+  int width = osd->width - d, height = osd->line_height - d;
+  FUNCTION_START(Dfunction);
+  XSetForeground(osd->display, osd->gc, pixel);
+  XSetClipMask(osd->display, osd->gc, bitmap);
+  XSetClipOrigin(osd->display, osd->gc, d, y + d);
+  XFillRectangle(osd->display, osd->line_bitmap, osd->gc, d, y + d, width,
+                 height);
+  XSetClipMask(osd->display, osd->gc, None);
+  XCopyArea(osd->display, bitmap, osd->mask_bitmap, osd->mask_gc_or, 0, 0,
+            width, height, d, y + d);
+  FUNCTION_END(Dfunction);
+}
+/* Grow the set pixels of the bitmap by radius along one axis. Each step ors
+ * the bitmap shifted by +d and -d onto itself, which extends the covered
+ * distance c to c+d for any d <= 2c+1, so radius n takes O(log n) copies. */
+static void                     /*inline */
+_dilate_bitmap(xosd * osd, Pixmap bitmap, int radius, int vertical)
+{
+  int c, d, dx, dy;
+  FUNCTION_START(Dfunction);
+  for (c = 0; c < radius; c += d) {
+    d = (2 * c + 1 < radius - c) ? 2 * c + 1 : radius - c;
+    dx = vertical ? 0 : d;
+    dy = vertical ? d : 0;
+    XCopyArea(osd->display, bitmap, bitmap, osd->mask_gc_or, 0, 0,
+              osd->width - dx, osd->line_height - dy, dx, dy);
+    XCopyArea(osd->display, bitmap, bitmap, osd->mask_gc_or, dx, dy,
+              osd->width - dx, osd->line_height - dy, 0, 0);
+  }
+  FUNCTION_END(Dfunction);
+}
+#ifdef HAVE_XFT
+/* Convert a string of the current locale to UCS-4 for Xft. On input len is
+ * the length in bytes, on return the number of characters. glibc's wchar_t
+ * already is UCS-4; invalid bytes are taken as Latin-1. The result is kept
+ * in osd->ucs until the next call, which only grows it for longer text. */
+static FcChar32 *
+_xft_string(xosd * osd, const char *string, int *len)
+{
+  const char *p = string, *end = string + *len;
+  FcChar32 *ucs;
+  mbstate_t state;
+  wchar_t wc;
+  size_t n;
+  int i = 0;
+
+  if (osd->ucs_size < *len + 1) {
+    ucs = realloc(osd->ucs, (*len + 1) * sizeof(FcChar32));
+    if (ucs == NULL)
+      return NULL;
+    osd->ucs = ucs;
+    osd->ucs_size = *len + 1;
+  }
+  ucs = osd->ucs;
+  memset(&state, 0, sizeof(state));
+  while (p < end) {
+    n = mbrtowc(&wc, p, end - p, &state);
+    if (n == 0)
+      break;
+    if (n == (size_t) - 1 || n == (size_t) - 2) {
+      memset(&state, 0, sizeof(state));
+      wc = (unsigned char) *p;
+      n = 1;
+    }
+    ucs[i++] = wc;
+    p += n;
+  }
+  *len = i;
+  return ucs;
+}
+#endif
+/* Measure the logical width of string for the layout and its ink for
+ * drawing, looking it up in the extents cache first. */
+static void
+text_extents(xosd * osd, const char *string, int *width, int *bearing,
+             int *ink)
+{
+  unsigned long hash = _xosd_hash(string);
+  struct xosd_extents *e = &osd->extents_cache[hash % XOSD_EXTENTS_SIZE];
+  XRectangle rect, logical;
+  int size = strlen(string), len = size;
+
+  FUNCTION_START(Dfunction);
+  if (e->hash == hash && strcmp(e->string, string) == 0) {
+    osd->stats.extents_hits++;
+    *width = e->width;
+    *bearing = e->bearing;
+    *ink = e->ink;
+    return;
+  }
+  osd->stats.extents_misses++;
+#ifdef HAVE_XFT
+  if (osd->xft) {
+    XGlyphInfo info;
+    FcChar32 *ucs = _xft_string(osd, string, &len);
+    rect.x = rect.width = logical.width = 0;
+    if (ucs) {
+      XftTextExtents32(osd->display, osd->xftfont, ucs, len, &info);
+      rect.x = -info.x;
+      rect.width = info.width;
+      logical.width = info.xOff;
+    }
+  } else
+#endif
+    XmbTextExtents(osd->fontset, string, len, &rect, &logical);
+  *width = logical.width;
+  *bearing = rect.x;
+  *ink = rect.width;
+
+  if (size >= XOSD_CACHE_KEY)
+    return;
+  strcpy(e->string, string);
+  e->hash = hash;
+  e->width = logical.width;
+  e->bearing = rect.x;
+  e->ink = rect.width;
+}
+/* Drop all measurements after the font changed. */
+static void
+extents_flush(xosd * osd)
+{
+  int i;
+
+  FUNCTION_START(Dfunction);
+  for (i = 0; i < XOSD_EXTENTS_SIZE; i++) {
+    osd->extents_cache[i].hash = 0;
+    osd->extents_cache[i].string[0] = '\0';
+  }
+}
+static void
+draw_text(xosd * osd, int line)
+{
+  int x = XOFFSET;
+  int y = osd->line_height * line;
+  int baseline = osd->outline_offset - osd->extent.y;
+  struct xosd_text *l = &LINE(osd, line)->text;
+  struct xosd_cache *e = NULL;
+  unsigned long hash = 0;
+  int len;
+#ifdef HAVE_XFT
+  FcChar32 *ucs = NULL;
+#endif
+
+  assert(osd);
+  FUNCTION_START(Dfunction);
+
+  if (l->string == NULL)
+    return;
+  len = strlen(l->string);
+
+  if (l->width < 0)
+    text_extents(osd, l->string, &l->width, &l->bearing, &l->ink);
+  x = _align_x(osd, l->width);
+
+  if (osd->cache_size) {
+    hash = l->hash;
+    e = cache_lookup(osd, l->string, hash);
+  }
+  if (e) {
+    XCopyArea(osd->display, e->pixmap, osd->line_bitmap, osd->gc, 0, 0,
+              e->width, osd->line_height, x + e->dx, y);
+    XCopyArea(osd->display, e->mask, osd->mask_bitmap, osd->mask_gc_or, 0, 0,
+              e->width, osd->line_height, x + e->dx, y);
+    return;
+  }
+
+#ifdef HAVE_XFT
+  if (osd->xft && (ucs = _xft_string(osd, l->string, &len)) == NULL)
+    return;
+#endif
+
+#ifdef HAVE_XFT
+  if (osd->image) {
+    image_draw_text(osd, ucs, len, x, y);
+    return;
+  }
+#endif
+
+  XFillRectangle(osd->display, osd->glyph_bitmap, osd->mask_gc_back, 0, 0,
+                 osd->width, osd->line_height);
+#ifdef HAVE_XFT
+  if (osd->xft) {
+    static const XftColor set = { 1, {0xffff, 0xffff, 0xffff, 0xffff} };
+    XftDrawString32(osd->xft_glyph, &set, osd->xftfont, x, baseline, ucs,
+                    len);
+  } else
+#endif
+    XmbDrawString(osd->display, osd->glyph_bitmap, osd->fontset,
+                  osd->mask_gc, x, baseline, l->string, len);
+
+  if (osd->shadow_offset)
+    _paint_bitmap(osd, osd->glyph_bitmap, osd->shadow_pixel, y,
+                  osd->shadow_offset);
+  if (osd->outline_offset) {
+    XCopyArea(osd->display, osd->glyph_bitmap, osd->outline_bitmap,
+              osd->mask_gc, 0, 0, osd->width, osd->line_height, 0, 0);
+    _dilate_bitmap(osd, osd->outline_bitmap, osd->outline_offset, 0);
+    _dilate_bitmap(osd, osd->outline_bitmap, osd->outline_offset, 1);
+    _paint_bitmap(osd, osd->outline_bitmap, osd->outline_pixel, y, 0);
+  }
+#ifdef HAVE_XFT
+  /* Without an outline the anti-aliased edge would be blended with whatever
+   * is below the shaped window, so only blend it over the outline, which
+   * also covers the glyphs in the XShape mask already. */
+  if (osd->xft && osd->outline_offset) {
+    XftColor colour;
+    colour.pixel = osd->pixel;
+    colour.color.red = osd->colour.red;
+    colour.color.green = osd->colour.green;
+    colour.color.blue = osd->colour.blue;
+    colour.color.alpha = 0xffff;
+    XftDrawString32(osd->xft_line, &colour, osd->xftfont, x, y + baseline,
+                    ucs, len);
+  } else
+#endif
+    _paint_bitmap(osd, osd->glyph_bitmap, osd->pixel, y, 0);
+
+  if (osd->cache_size)
+    cache_add(osd, l->string, hash, x, l->bearing - osd->outline_offset, y,
+              l->ink + 2 * osd->outline_offset + osd->shadow_offset);
+}
+
+/* Set the logical extent of the current font. */
+static void
+font_extent(xosd * osd, XRectangle * extent)
+{
+#ifdef HAVE_XFT
+  if (osd->xft) {
+    extent->x = 0;
+    extent->y = -osd->xftfont->ascent;
+    extent->width = osd->xftfont->max_advance_width;
+    extent->height = osd->xftfont->ascent + osd->xftfont->descent;
+  } else
+#endif
+    *extent = XExtentsOfFontSet(osd->fontset)->max_logical_extent;
+}
+
+/* }}} */
+
+/* Fit the window to the content. {{{ */
+/* Return the width needed to show all lines. */
+static int
+layout_width(xosd * osd)
+{
+  int line, width = 0, w;
+  XRectangle p;
+
+  FUNCTION_START(Dfunction);
+  for (line = 0; line < osd->number_lines; line++) {
+    union xosd_line *l = LINE(osd, line);
+    switch (l->type) {
+    case LINE_text:
+      if (l->text.string == NULL)
+        continue;
+      if (l->text.width < 0)
+        text_extents(osd, l->text.string, &l->text.width,
+                     &l->text.bearing, &l->text.ink);
+      w = l->text.width;
+      break;
+    case LINE_percentage:
+    case LINE_slider:
+      w = _bar_segments(osd, &p) * p.width;
+      break;
+    case LINE_blank:
+    default:
+      continue;
+    }
+    if (w > width)
+      width = w;
+  }
+  return width + 2 * (XOFFSET + osd->outline_offset) + osd->shadow_offset;
+}
+/* Estimate the server memory of the window bitmaps. */
+static unsigned long
+pixmap_bytes(xosd * osd)
+{
+  int bpp = (osd->depth > 16) ? 4 : (osd->depth > 8) ? 2 : 1;
+  unsigned long line = (osd->width + 7) / 8;
+
+  return (unsigned long) osd->height * (osd->width * bpp + line) +
+    3UL * osd->line_height * line;
+}
+
+/* }}} */
+
+/* Update XShape from mask. {{{
+ * Converting the full mask bitmap to a region is expensive on wide screens,
+ * so when only a few lines changed, their bands are cut out of the current
+ * shape and replaced by the band of the mask alone. */
+static void
+update_shape(xosd * osd, int full)
+{
+  int line, dirty = 0;
+  XRectangle band;
+
+  FUNCTION_START(Dfunction);
+  for (line = 0; !full && line < osd->number_lines; line++)
+    if (DIRTY_ISSET(osd, line))
+      dirty++;
+  if (full || 2 * dirty > osd->number_lines) {
+    XShapeCombineMask(osd->display, osd->window, ShapeBounding, 0, 0,
+                      osd->mask_bitmap, ShapeSet);
+    return;
+  }
+
+  band.x = 0;
+  band.width = osd->width;
+  band.height = osd->line_height;
+  for (line = 0; line < osd->number_lines; line++) {
+    if (!DIRTY_ISSET(osd, line))
+      continue;
+    band.y = osd->line_height * line;
+    XCopyArea(osd->display, osd->mask_bitmap, osd->band_bitmap, osd->mask_gc,
+              0, band.y, osd->width, osd->line_height, 0, 0);
+    XShapeCombineRectangles(osd->display, osd->window, ShapeBounding, 0, 0,
+                            &band, 1, ShapeSubtract, YXBanded);
+    XShapeCombineMask(osd->display, osd->window, ShapeBounding, 0, band.y,
+                      osd->band_bitmap, ShapeUnion);
+  }
+  FUNCTION_END(Dfunction);
+}
+
+/* }}} */
+
+/* Move drawn content up. {{{
+ * After scrolling, the lines still shown are moved within the bitmaps, the
+ * client image and the XShape, so only the new lines have to be drawn. */
+static void
+scroll_content(xosd * osd, int lines)
+{
+  int dy = osd->line_height * lines, height = osd->height - dy;
+#ifndef DEBUG_XSHAPE
+  XRectangle keep;
+#endif
+
+  FUNCTION_START(Dfunction);
+#ifdef HAVE_XFT
+  if (osd->image && osd->line_image) {
+    XImage *i = osd->line_image, *m = osd->mask_image;
+    memmove(i->data, i->data + i->bytes_per_line * dy,
+            i->bytes_per_line * height);
+    memmove(m->data, m->data + m->bytes_per_line * dy,
+            m->bytes_per_line * height);
+  }
+#endif
+  XCopyArea(osd->display, osd->line_bitmap, osd->line_bitmap, osd->gc,
+            0, dy, osd->width, height, 0, 0);
+  XCopyArea(osd->display, osd->mask_bitmap, osd->mask_bitmap, osd->mask_gc,
+            0, dy, osd->width, height, 0, 0);
+#ifndef DEBUG_XSHAPE
+  /* The new lines are added to the shape by update_shape(). */
+  keep.x = keep.y = 0;
+  keep.width = osd->width;
+  keep.height = height;
+  XShapeOffsetShape(osd->display, osd->window, ShapeBounding, 0, -dy);
+  XShapeCombineRectangles(osd->display, osd->window, ShapeBounding, 0, 0,
+                          &keep, 1, ShapeIntersect, YXBanded);
+#endif
+  FUNCTION_END(Dfunction);
+}
+
+/* }}} */
+
+/* Process-wide cache of fontsets. {{{
+ * XCreateFontSet() is slow, so fontsets are shared by all xosd objects and
+ * kept while they are in use. A fontset belongs to one display connection
+ * and depends on the locale, so both are part of the key. The event threads
+ * of all objects use the cache, hence the mutex. */
+struct xosd_fontset
+{
+  struct xosd_fontset *next;
+  Display *display;
+  char *font;
+  char *locale;                 /* LC_CTYPE when created */
+  XFontSet fontset;
+  int refs;
+};
+static struct xosd_fontset *_xosd_fontsets;
+static pthread_mutex_t _xosd_fontsets_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return a reference to the fontset for font, or NULL if none matches. */
+static XFontSet
+fontset_get(Display * display, const char *font)
+{
+  const char *locale = setlocale(LC_CTYPE, NULL);
+  struct xosd_fontset *f;
+  XFontSet fontset;
+  char **missing;
+  int nmissing;
+  char *defstr;
+
+  FUNCTION_START(Dfunction);
+  if (locale == NULL)
+    locale = "C";
+  pthread_mutex_lock(&_xosd_fontsets_mutex);
+  for (f = _xosd_fontsets; f; f = f->next)
+    if (f->display == display && strcmp(f->font, font) == 0
+        && strcmp(f->locale, locale) == 0) {
+      f->refs++;
+      pthread_mutex_unlock(&_xosd_fontsets_mutex);
+      return f->fontset;
+    }
+  pthread_mutex_unlock(&_xosd_fontsets_mutex);
+
+  fontset = XCreateFontSet(display, font, &missing, &nmissing, &defstr);
+  XFreeStringList(missing);
+  if (fontset == NULL)
+    return NULL;
+
+  f = malloc(sizeof(struct xosd_fontset));
+  if (f == NULL || (f->font = strdup(font)) == NULL) {
+    free(f);
+    return fontset;             /* unshared, freed by fontset_put() */
+  }
+  if ((f->locale = strdup(locale)) == NULL) {
+    free(f->font);
+    free(f);
+    return fontset;
+  }
+  f->display = display;
+  f->fontset = fontset;
+  f->refs = 1;
+  pthread_mutex_lock(&_xosd_fontsets_mutex);
+  f->next = _xosd_fontsets;
+  _xosd_fontsets = f;
+  pthread_mutex_unlock(&_xosd_fontsets_mutex);
+  return fontset;
+}
+/* Drop a reference, freeing the fontset with the last one. */
+static void
+fontset_put(Display * display, XFontSet fontset)
+{
+  struct xosd_fontset *f, **prev;
+
+  FUNCTION_START(Dfunction);
+  if (fontset == NULL)
+    return;
+  pthread_mutex_lock(&_xosd_fontsets_mutex);
+  for (prev = &_xosd_fontsets; (f = *prev); prev = &f->next)
+    if (f->fontset == fontset) {
+      if (--f->refs > 0) {
+        pthread_mutex_unlock(&_xosd_fontsets_mutex);
+        return;
+      }
+      *prev = f->next;
+      free(f->font);
+      free(f->locale);
+      free(f);
+      break;
+    }
+  pthread_mutex_unlock(&_xosd_fontsets_mutex);
+  XFreeFontSet(display, fontset);
+}
+/* Free all fontsets still cached for display before it is closed, so a
+ * later connection at the same address cannot find them. Only objects left
+ * behind by a failed event loop still hold references then. */
+static void
+fontset_forget(Display * display)
+{
+  struct xosd_fontset *f, **prev;
+
+  FUNCTION_START(Dfunction);
+  pthread_mutex_lock(&_xosd_fontsets_mutex);
+  for (prev = &_xosd_fontsets; (f = *prev);)
+    if (f->display == display) {
+      *prev = f->next;
+      XFreeFontSet(display, f->fontset);
+      free(f->font);
+      free(f->locale);
+      free(f);
+    } else
+      prev = &f->next;
+  pthread_mutex_unlock(&_xosd_fontsets_mutex);
+}
+
+/* }}} */
+
+/* Change the font. {{{
+ * Might return error if fontset can't be created. Requesting the current
+ * font again changes nothing. **/
+#ifdef HAVE_XFT
+/* Switch from Xft to core fonts, everything is drawn again. */
+static void
+render_core(xosd * osd)
+{
+  int line;
+
+  FUNCTION_START(Dfunction);
+  DEBUG(Dtrace, "falling back to core fonts");
+  if (osd->image) {
+    image_free(osd);
+    osd->cache_size = XOSD_CACHE_SIZE;
+  } else {
+    XftDrawDestroy(osd->xft_line);
+    XftDrawDestroy(osd->xft_glyph);
+  }
+  if (osd->xftfont != NULL) {
+    XftFontClose(osd->display, osd->xftfont);
+    osd->xftfont = NULL;
+  }
+  osd->xft = osd->image = 0;
+#ifdef USE_XSHM
+  osd->shm = 0;
+#endif
+  for (line = 0; line < osd->number_lines; line++)
+    if (osd->lines[line].type == LINE_percentage
+        || osd->lines[line].type == LINE_slider)
+      osd->lines[line].bar.drawn = -1;
+  DIRTY_ALL(osd);
+}
+#endif
+static int
+set_font(xosd * osd, const char *font)
+{
+  XFontSet fontset2;
+
+  FUNCTION_START(Dfunction);
+#ifdef HAVE_XFT
+  /* Xft takes XLFDs as well as fontconfig names like "Sans-24". */
+  if (osd->xft) {
+    XftFont *xftfont;
+    if (font[0] == '-')
+      xftfont = XftFontOpenXlfd(osd->display, osd->screen, font);
+    else
+      xftfont = XftFontOpenName(osd->display, osd->screen, font);
+    /* An XLFD Xft cannot resolve may still name a core font. */
+    if (xftfont == NULL && font[0] == '-'
+        && (fontset2 = fontset_get(osd->display, font)) != NULL) {
+      render_core(osd);
+      osd->fontset = fontset2;
+      extents_flush(osd);
+      osd->update |= UPD_font;
+      return 0;
+    }
+    if (xftfont == NULL) {
+      xosd_error = "Requested font not found";
+      return -1;
+    }
+    /* Xft keeps its own cache of open fonts. */
+    if (xftfont == osd->xftfont) {
+      XftFontClose(osd->display, xftfont);
+      return 0;
+    }
+    if (osd->xftfont != NULL)
+      XftFontClose(osd->display, osd->xftfont);
+    osd->xftfont = xftfont;
+    extents_flush(osd);
+    osd->update |= UPD_font;
+    return 0;
+  }
+#endif
+  /*
+   * Try to create the new font. If it doesn't succeed, keep old font. 
+   */
+  fontset2 = fontset_get(osd->display, font);
+  if (fontset2 == NULL) {
+    xosd_error = "Requested font not found";
+    return -1;
+  }
+  if (fontset2 == osd->fontset) {
+    fontset_put(osd->display, fontset2);
+    return 0;
+  }
+  if (osd->fontset != NULL)
+    fontset_put(osd->display, osd->fontset);
+  osd->fontset = fontset2;
+  extents_flush(osd);
+  osd->update |= UPD_font;
+  return 0;
+}
+/* Return whether a font was loaded. */
+static int
+have_font(xosd * osd)
+{
+#ifdef HAVE_XFT
+  if (osd->xft)
+    return osd->xftfont != NULL;
+#endif
+  return osd->fontset != NULL;
+}
+/* Load the default font unless a font was set. This is deferred until the
+ * font is needed, since most programs set their own font right after
+ * xosd_create(). */
+static int
+default_font(xosd * osd)
+{
+  FUNCTION_START(Dfunction);
+  if (have_font(osd))
+    return 0;
+  if (set_font(osd, osd_default_font) == 0)
+    return 0;
+#ifdef HAVE_XFT
+  /* Fall back to core fonts. */
+  if (osd->xft) {
+    render_core(osd);
+    if (set_font(osd, osd_default_font) == 0)
+      return 0;
+  }
+#endif
+  xosd_error = "Default font not found";
+  return -1;
+}
+
+/* }}} */
+
+/* Apply commands posted by the API. {{{
+ * This runs in the event-thread. The resulting osd->update is handled
+ * afterwards by update_display(). */
+/* Return whether line a shows the same as b. */
+static int
+same_line(const union xosd_line *a, const union xosd_line *b)
+{
+  if (a->type != b->type)
+    return 0;
+  switch (a->type) {
+  case LINE_blank:
+    return 1;
+  case LINE_text:
+    /* A borrowed buffer may be reused with new content, so the same pointer
+     * proves nothing; the hash was taken when each line was posted. */
+    return a->text.length == b->text.length && a->text.hash == b->text.hash
+      && memcmp(a->text.string, b->text.string, a->text.length) == 0;
+  case LINE_percentage:
+  case LINE_slider:
+    return a->bar.value == b->bar.value;
+  }
+  return 0;
+}
+
+/* Move the dirty bits of the lines up, the new last lines are dirty. */
+static void
+dirty_scroll(xosd * osd, int lines)
+{
+  int words = DIRTY_WORDS(osd->number_lines);
+  int skip = lines / DIRTY_BITS, shift = lines % DIRTY_BITS, i;
+  unsigned long bits;
+
+  for (i = 0; i < words; i++) {
+    bits = (i + skip < words) ? osd->dirty[i + skip] >> shift : 0;
+    if (shift && i + skip + 1 < words)
+      bits |= osd->dirty[i + skip + 1] << (DIRTY_BITS - shift);
+    osd->dirty[i] = bits;
+  }
+  for (i = osd->number_lines - lines; i < osd->number_lines; i++)
+    DIRTY_SET(osd, i);
+}
+
+/* Copy string into the storage of line, which only grows when needed. */
+static int
+line_text(xosd * osd, int line, const char *string)
+{
+  struct xosd_buf *buf = &osd->line_bufs[LINE_SLOT(osd, line)];
+  size_t size = strlen(string) + 1;
+  char *data;
+
+  if (size > buf->size) {
+    data = realloc(buf->data, size);
+    if (data == NULL) {
+      LINE(osd, line)->type = LINE_blank;
+      LINE(osd, line)->text.string = NULL;
+      xosd_error = "Out of memory";
+      return -1;
+    }
+    buf->data = data;
+    buf->size = size;
+  }
+  memcpy(buf->data, string, size);
+  LINE(osd, line)->text.string = buf->data;
+  return 0;
+}
+
+/* Whether the display is shown after the pending update. */
+#define SHOWN(osd, update) \
+  ((update) & UPD_show || ((osd)->generation & 1 && !((update) & UPD_hide)))
+
+static void
+apply_command(xosd * osd, struct xosd_cmd *cmd)
+{
+  int ret = 0, i, update = osd->update;
+  union xosd_line *dst;
+
+  FUNCTION_START(Dfunction);
+  osd->update = UPD_none;
+  switch (cmd->type) {
+  case CMD_display:
+    dst = LINE(osd, cmd->value);
+    /* Pollers resend the same content, that only restarts the timer. */
+    if (same_line(dst, &cmd->line)) {
+      osd->stats.redraws_suppressed++;
+      osd->update |= UPD_timer | UPD_show;
+      break;
+    }
+    /* A bar only changing its value just redraws the flipped segments. */
+    if (dst->type == cmd->line.type && dst->type != LINE_text)
+      cmd->line.bar.drawn = dst->bar.drawn;
+    *dst = cmd->line;
+    /* Borrowed text is used in place, other text goes to the line. */
+    if (dst->type == LINE_text && !cmd->borrowed)
+      ret = line_text(osd, cmd->value, cmd->line.text.string);
+    DIRTY_SET(osd, cmd->value);
+    osd->update |= UPD_content | UPD_timer | UPD_show;
+    break;
+  case CMD_colour:
+    ret = parse_colour(osd, &osd->colour, &osd->pixel, cmd->name);
+    DIRTY_ALL(osd);
+    osd->update |= UPD_lines;
+    break;
+  case CMD_shadow_colour:
+    ret = parse_colour(osd, &osd->shadow_colour, &osd->shadow_pixel,
+                       cmd->name);
+    DIRTY_ALL(osd);
+    osd->update |= UPD_lines;
+    break;
+  case CMD_outline_colour:
+    ret = parse_colour(osd, &osd->outline_colour, &osd->outline_pixel,
+                       cmd->name);
+    DIRTY_ALL(osd);
+    osd->update |= UPD_lines;
+    break;
+  case CMD_font:
+    ret = set_font(osd, cmd->name);
+    break;
+  case CMD_shadow_offset:
+    osd->shadow_offset = cmd->value;
+    osd->update |= UPD_font;
+    break;
+  case CMD_outline_offset:
+    osd->outline_offset = cmd->value;
+    osd->update |= UPD_font;
+    break;
+  case CMD_vertical_offset:
+    osd->voffset = cmd->value;
+    osd->update |= UPD_pos;
+    break;
+  case CMD_horizontal_offset:
+    osd->hoffset = cmd->value;
+    osd->update |= UPD_pos;
+    break;
+  case CMD_pos:
+    osd->pos = cmd->value;
+    osd->update |= UPD_pos;
+    break;
+  case CMD_align:
+    osd->align = cmd->value;
+    DIRTY_ALL(osd);
+    osd->update |= UPD_content | UPD_pos;
+    break;
+  case CMD_bar_length:
+    osd->bar_length = cmd->value;
+    DIRTY_ALL(osd);
+    osd->update |= UPD_content;
+    break;
+  case CMD_timeout:
+    osd->timeout = cmd->value;
+    osd->update |= UPD_timer;
+    break;
+  /* Whether the display is shown is decided here, including what the
+   * commands applied before will show; the callers' view lags behind. */
+  case CMD_hide:
+    if (!SHOWN(osd, update)) {
+      ret = -1;
+      break;
+    }
+    update &= ~UPD_show;
+    osd->update |= UPD_hide;
+    break;
+  case CMD_show:
+    if (SHOWN(osd, update)) {
+      ret = -1;
+      break;
+    }
+    update &= ~UPD_hide;
+    osd->update |= UPD_show | UPD_timer;
+    break;
+  case CMD_scroll:
+    /* The scrolled out lines become the new blank lines at the end of
+     * the ring. The drawn content is moved up by update_display(), so
+     * only the new lines are drawn. */
+    for (i = 0; i < cmd->value; i++) {
+      dst = LINE(osd, i);
+      dst->type = LINE_blank;
+      dst->text.string = NULL;
+    }
+    osd->first_line = LINE_SLOT(osd, cmd->value);
+    dirty_scroll(osd, cmd->value);
+    osd->scrolled += cmd->value;
+    osd->update |= UPD_scroll | UPD_content;
+    break;
+  case CMD_cache_size:
+#ifdef HAVE_XFT
+    /* Entries are copied from line_bitmap, which the client rasterizer only
+     * fills after all lines are drawn. */
+    if (osd->image)
+      break;
+#endif
+    osd->cache_size = cmd->value;
+    cache_trim(osd, osd->cache_size);
+    break;
+  case CMD_extents:
+    /* Measured like draw_text() would draw it, possibly before the pending
+     * font change reached update_display(). */
+    ret = default_font(osd);
+    if (cmd->result && ret == 0) {
+      XRectangle extent;
+      int bearing, ink;
+      font_extent(osd, &extent);
+      text_extents(osd, cmd->name, &cmd->result[1], &bearing, &ink);
+      cmd->result[1] += 2 * osd->outline_offset + osd->shadow_offset;
+      cmd->result[2] = extent.height + 2 * osd->outline_offset +
+        osd->shadow_offset;
+    }
+    break;
+  case CMD_quit:
+    osd->done = 1;
+    break;
+  }
+  /* Any other change of content needs bars drawn from scratch. Scrolled
+   * bars are moved together with their drawn segments. */
+  if (cmd->type != CMD_display && cmd->type != CMD_scroll
+      && (osd->update & UPD_lines))
+    for (i = 0; i < osd->number_lines; i++)
+      if (osd->lines[i].type == LINE_percentage
+          || osd->lines[i].type == LINE_slider)
+        osd->lines[i].bar.drawn = -1;
+  osd->update |= update;
+  if (cmd->result)
+    *cmd->result = ret;
+  FUNCTION_END(Dfunction);
+}
+/* Take all queued commands and return them reversed into posting order. */
+static struct xosd_cmd *
+_xosd_take(xosd * osd)
+{
+  struct xosd_cmd *cmd, *next, *list = NULL;
+
+  cmd = __atomic_exchange_n(&osd->queue, NULL, __ATOMIC_ACQ_REL);
+  for (; cmd; cmd = next) {
+    while ((next = __atomic_load_n(&cmd->next, __ATOMIC_ACQUIRE))
+           == CMD_PENDING)
+      sched_yield();
+    cmd->next = list;
+    list = cmd;
+  }
+  return list;
+}
+static void
+apply_commands(xosd * osd)
+{
+  struct xosd_cmd *cmd, *next, *list, *last = NULL;
+
+  FUNCTION_START(Dfunction);
+  list = _xosd_take(osd);
+  for (cmd = list; cmd; cmd = next) {
+    next = cmd->next;
+    DEBUG(Dupdate, "command %d seq=%lu", cmd->type, cmd->seq);
+    apply_command(osd, cmd);
+    osd->seq_applied++;
+    if ((long) (cmd->seq - osd->seq_max) > 0)
+      osd->seq_max = cmd->seq;
+    last = cmd;
+  }
+  /* The list is still linked in order, give it back in one go. */
+  if (list)
+    _xosd_cmd_put(osd, list, last);
+  FUNCTION_END(Dfunction);
+}
+
+/* }}} */
+
+/* Monotonic hide timer. {{{
+ * The deadline is kept as an absolute CLOCK_MONOTONIC time, so changing the
+ * wall-clock neither hides the display early nor keeps it forever. Where
+ * timerfd is available the kernel wakes the event-thread through
+ * context->timerfd, armed for the earliest deadline of all objects of the
+ * context; otherwise the remaining time is passed to select().
+ */
+static int
+_xosd_timer_open(xosd_context * ctx)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+  ctx->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  return ctx->timerfd;
+#else
+  ctx->timerfd = -1;
+  return 0;
+#endif
+}
+static void
+_xosd_timer_close(xosd_context * ctx)
+{
+  if (ctx->timerfd != -1)
+    close(ctx->timerfd);
+}
+/* Start the timer to expire in ms milliseconds, stop it if ms < 0. */
+static void
+_xosd_timer_set(xosd * osd, int ms)
+{
+  if (ms < 0) {
+    osd->timeout_end.tv_sec = osd->timeout_end.tv_nsec = 0;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &osd->timeout_end);
+    osd->timeout_end.tv_sec += ms / 1000;
+    osd->timeout_end.tv_nsec += (ms % 1000) * 1000000L;
+    if (osd->timeout_end.tv_nsec >= 1000000000L) {
+      osd->timeout_end.tv_nsec -= 1000000000L;
+      osd->timeout_end.tv_sec += 1;
+    }
+  }
+}
+/* Arm the timerfd for the earliest deadline, unless it already is. */
+static void
+_xosd_timer_arm(xosd_context * ctx)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+  struct itimerspec its;
+  xosd *osd;
+
+  /* An all-zero it_value disarms the timer. */
+  memset(&its, 0, sizeof(its));
+  for (osd = ctx->osds; osd; osd = osd->next) {
+    struct timespec *t = &osd->timeout_end;
+    if (t->tv_sec == 0 && t->tv_nsec == 0)
+      continue;
+    if ((its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        || t->tv_sec < its.it_value.tv_sec
+        || (t->tv_sec == its.it_value.tv_sec
+            && t->tv_nsec < its.it_value.tv_nsec))
+      its.it_value = *t;
+  }
+  if (its.it_value.tv_sec == ctx->timer_armed.tv_sec
+      && its.it_value.tv_nsec == ctx->timer_armed.tv_nsec)
+    return;
+  ctx->timer_armed = its.it_value;
+  timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+/* Return -1 if no timer is running, 0 if it expired, else 1 and the
+ * remaining time in tv. */
+static int
+_xosd_timer_left(xosd * osd, struct timeval *tv)
+{
+  struct timespec now;
+  long nsec;
+
+  if (osd->timeout_end.tv_sec == 0 && osd->timeout_end.tv_nsec == 0)
+    return -1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  tv->tv_sec = osd->timeout_end.tv_sec - now.tv_sec;
+  nsec = osd->timeout_end.tv_nsec - now.tv_nsec;
+  if (nsec < 0) {
+    nsec += 1000000000L;
+    tv->tv_sec -= 1;
+  }
+  if (tv->tv_sec < 0 || (tv->tv_sec == 0 && nsec == 0))
+    return 0;
+  /* Round up, so select() never returns before the deadline. */
+  tv->tv_usec = (nsec + 999) / 1000;
+  if (tv->tv_usec == 1000000) {
+    tv->tv_usec = 0;
+    tv->tv_sec += 1;
+  }
+  return 1;
+}
+static void
+_xosd_timer_drain(xosd_context * ctx)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+  uint64_t expirations;
+  read(ctx->timerfd, &expirations, sizeof(expirations));
+  /* Re-arm even if the next deadline happens to be the same. */
+  ctx->timer_armed.tv_sec = ctx->timer_armed.tv_nsec = 0;
+#endif
+}
+
+/* }}} */
+
+/* Tell window manager to put window topmost. {{{
+ * The atoms are interned with one round trip and the protocol of the window
+ * manager is probed once per context. */
+static void
+stay_on_top(xosd * osd)
+{
+  static char *names[] = {
+    "_WIN_SUPPORTING_WM_CHECK", "_NET_SUPPORTED", "_WIN_LAYER",
+    "_NET_WM_STATE", "_NET_WM_STATE_STAYS_ON_TOP"
+  };
+  enum { WIN_CHECK, NET_SUPPORTED, WIN_LAYER, NET_STATE, NET_STATE_TOP };
+  xosd_context *ctx = osd->context;
+  Display *dpy = osd->display;
+  Window win = osd->window;
+  Window root = DefaultRootWindow(dpy);
+  Atom *atoms = ctx->wm_atoms;
+
+  FUNCTION_START(Dfunction);
+  if (ctx->wm == WM_unknown) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytesafter;
+    unsigned char *args = NULL;
+
+    XInternAtoms(dpy, names, sizeof(names) / sizeof(names[0]), False, atoms);
+    ctx->wm = WM_none;
+    /*
+     * gnome-compilant 
+     * tested with icewm + WindowMaker 
+     */
+    if (Success == XGetWindowProperty
+        (dpy, root, atoms[WIN_CHECK], 0, (65536 / sizeof(long)), False,
+         AnyPropertyType, &type, &format, &nitems, &bytesafter, &args) &&
+        nitems > 0)
+      ctx->wm = WM_gnome;
+    /*
+     * netwm compliant.
+     * tested with kde 
+     */
+    else if (Success == XGetWindowProperty
+             (dpy, root, atoms[NET_SUPPORTED], 0, (65536 / sizeof(long)),
+              False, AnyPropertyType, &type, &format, &nitems, &bytesafter,
+              &args) && nitems > 0)
+      ctx->wm = WM_netwm;
+    if (args)
+      XFree(args);
+  }
+
+  if (ctx->wm == WM_gnome) {
+    /*
+     * FIXME: check capabilities 
+     */
+    XClientMessageEvent xev;
+
+    memset(&xev, 0, sizeof(xev));
+    xev.type = ClientMessage;
+    xev.window = win;
+    xev.message_type = atoms[WIN_LAYER];
+    xev.format = 32;
+    xev.data.l[0] = 6 /* WIN_LAYER_ONTOP */ ;
+
+    XSendEvent(dpy, DefaultRootWindow(dpy), False, SubstructureNotifyMask,
+               (XEvent *) & xev);
+  } else if (ctx->wm == WM_netwm) {
+    XEvent e;
+
+    memset(&e, 0, sizeof(e));
+    e.xclient.type = ClientMessage;
+    e.xclient.message_type = atoms[NET_STATE];
+    e.xclient.display = dpy;
+    e.xclient.window = win;
+    e.xclient.format = 32;
+    e.xclient.data.l[0] = 1 /* _NET_WM_STATE_ADD */ ;
+    e.xclient.data.l[1] = atoms[NET_STATE_TOP];
+    e.xclient.data.l[2] = 0l;
+    e.xclient.data.l[3] = 0l;
+    e.xclient.data.l[4] = 0l;
+
+    XSendEvent(dpy, DefaultRootWindow(dpy), False,
+               SubstructureRedirectMask, &e);
+  }
+  XRaiseWindow(dpy, win);
+}
+
+/* }}} */
+
+/* Report events through event_fd, once it was asked for. The descriptor
+ * is only signalled when no events were pending yet, xosd_read_events()
+ * drains it before taking the events. */
+static void
+post_event(xosd * osd, int events)
+{
+  if (events && osd->events_on
+      && __sync_fetch_and_or(&osd->events, events) == 0)
+    _xosd_notify(osd->event_fd);
+}
+
+/* Update the display as requested by osd->update. {{{
+ * The order of update handling is important:
+ * 1. The size must be correct -> UPD_size and UPD_width first
+ * 2. Change the position, which might expose part of window -> UPD_pos
+ * 3. The XShape must be set before something is drawn -> UPD_mask, UPD_lines
+ * 4. The window should be mapped before something is drawn -> UPD_show
+ * 5. Start the timer last to not account for processing time -> UPD_timer
+ * If you change this order, you'll get a broken display. You've been warned!
+ */
+static void
+update_display(xosd * osd)
+{
+  int line, events = 0;
+  unsigned long start;
+
+  FUNCTION_START(Dfunction);
+  /* Nothing is drawn before the display is shown for the first time, so the
+   * default font is only loaded when no other font was set until then. */
+  if (!have_font(osd)) {
+    if (!(osd->update & UPD_show))
+      return;
+    if (default_font(osd) == -1) {
+      DEBUG(Dupdate, "no font");
+      /* Count as shown and hidden again to release threads waiting for
+       * the window to be mapped, they return the error. */
+      osd->no_font = 1;
+      osd->generation += 2;
+      osd->update = UPD_none;
+      osd->scrolled = 0;
+      return;
+    }
+  }
+  /* Hide display requested. */
+  if (osd->update & UPD_hide) {
+    DEBUG(Dupdate, "UPD_hide");
+    if (osd->generation & 1) {
+      XUnmapWindow(osd->display, osd->window);
+      osd->generation++;
+      events |= XOSD_event_hide;
+    }
+  }
+  start = _xosd_clock_ns();
+  /* The font, outline or shadow was changed. Recalculate line height. */
+  if (osd->update & UPD_size) {
+    DEBUG(Dupdate, "UPD_size");
+    cache_trim(osd, 0);
+    font_extent(osd, &osd->extent);
+    osd->line_height = osd->extent.height + osd->shadow_offset + 2 *
+      osd->outline_offset;
+    osd->height = osd->line_height * osd->number_lines;
+    for (line = 0; line < osd->number_lines; line++)
+      if (osd->lines[line].type == LINE_text)
+        osd->lines[line].text.width = -1;
+    osd->update |= UPD_width;
+  }
+  /* Fit the window to the widest line. It grows with some slack and only
+   * shrinks once less than half of it is used, so changing the text does
+   * not resize it on every update. */
+  if (osd->update & (UPD_width | UPD_lines)) {
+    int width = layout_width(osd);
+    if (width > osd->screen_width)
+      width = osd->screen_width;
+    if (width > osd->width || 2 * width < osd->width) {
+      width += width / 4;
+      osd->width = (width < osd->screen_width) ? width : osd->screen_width;
+      osd->update |= UPD_width;
+    }
+  }
+  /* Resize window and bitmaps, everything needs to be redrawn. */
+  if (osd->update & UPD_width) {
+    DEBUG(Dupdate, "UPD_width %d", osd->width);
+    for (line = 0; line < osd->number_lines; line++)
+      if (osd->lines[line].type == LINE_percentage
+          || osd->lines[line].type == LINE_slider)
+        osd->lines[line].bar.drawn = -1;
+    DIRTY_ALL(osd);
+    osd->update |= UPD_pos | UPD_content;
+
+    XResizeWindow(osd->display, osd->window, osd->width, osd->height);
+    XFreePixmap(osd->display, osd->mask_bitmap);
+    osd->mask_bitmap = XCreatePixmap(osd->display, osd->window,
+                                     osd->width, osd->height, 1);
+    XFreePixmap(osd->display, osd->line_bitmap);
+    osd->line_bitmap = XCreatePixmap(osd->display, osd->window,
+                                     osd->width, osd->height,
+                                     osd->depth);
+    XFreePixmap(osd->display, osd->band_bitmap);
+    osd->band_bitmap = XCreatePixmap(osd->display, osd->window,
+                                     osd->width, osd->line_height, 1);
+    XFreePixmap(osd->display, osd->glyph_bitmap);
+    osd->glyph_bitmap = XCreatePixmap(osd->display, osd->window,
+                                      osd->width, osd->line_height, 1);
+    XFreePixmap(osd->display, osd->outline_bitmap);
+    osd->outline_bitmap = XCreatePixmap(osd->display, osd->window,
+                                        osd->width, osd->line_height,
+                                        1);
+    osd->stats.pixmap_bytes = pixmap_bytes(osd);
+#ifdef HAVE_XFT
+    if (osd->image) {
+      if (image_create(osd) == -1)
+        image_fallback(osd);
+    } else if (osd->xft) {
+      XftDrawChange(osd->xft_line, osd->line_bitmap);
+      XftDrawChange(osd->xft_glyph, osd->glyph_bitmap);
+    }
+#endif
+  }
+  if (osd->update & (UPD_size | UPD_width))
+    stage_done(osd, XOSD_stage_size, start);
+  /* H/V offset, position or alignment was changed, or the window was
+   * resized. Lines are aligned within the window with UPD_content, the
+   * window itself is aligned on the screen here. */
+  if (osd->update & UPD_pos) {
+    int x = 0, y = 0;
+    DEBUG(Dupdate, "UPD_pos");
+    start = _xosd_clock_ns();
+    switch (osd->align) {
+    case XOSD_left:
+      x = osd->screen_xpos + osd->hoffset;
+      break;
+    case XOSD_center:
+      x = osd->screen_xpos + osd->hoffset +
+        (osd->screen_width - osd->width) / 2;
+      break;
+    case XOSD_right:
+      x = osd->screen_xpos - osd->hoffset + osd->screen_width - osd->width;
+    }
+    switch (osd->pos) {
+    case XOSD_bottom:
+      y = osd->screen_height - osd->height - osd->voffset;
+      break;
+    case XOSD_middle:
+      y = (osd->screen_height - osd->height) / 2 - osd->voffset;
+      break;
+    case XOSD_top:
+      y = osd->voffset;
+    }
+    XMoveWindow(osd->display, osd->window, x, y);
+    stage_done(osd, XOSD_stage_pos, start);
+  }
+  start = _xosd_clock_ns();
+#ifdef HAVE_XFT
+  if (osd->image) {
+    if (osd->line_image == NULL)
+      image_fallback(osd);
+    else if (osd->update & (UPD_scroll | UPD_mask | UPD_lines))
+      image_wait(osd);
+  }
+#endif
+  /* Lines were scrolled. Resized bitmaps are drawn from scratch anyway,
+   * as are all lines when all of them were scrolled out. */
+  if (osd->update & UPD_scroll) {
+    DEBUG(Dupdate, "UPD_scroll %d", osd->scrolled);
+    if (!(osd->update & UPD_width) && osd->scrolled < osd->number_lines)
+      scroll_content(osd, osd->scrolled);
+    osd->scrolled = 0;
+  }
+  /* If the content changed, redraw dirty lines in background buffer.
+   * Also update XShape unless only colours were changed. */
+  if (osd->update & (UPD_mask | UPD_lines)) {
+    DEBUG(Dupdate, "UPD_lines");
+    for (line = 0; line < osd->number_lines; line++) {
+      int y = osd->line_height * line;
+      union xosd_line *l = LINE(osd, line);
+      /* A bar already on screen clears only the segments it redraws. */
+      int delta = (l->type == LINE_percentage || l->type == LINE_slider)
+        && l->bar.drawn >= 0;
+      if (!DIRTY_ISSET(osd, line))
+        continue;
+#ifdef DEBUG_XSHAPE
+      XSetForeground(osd->display, osd->gc, osd->outline_pixel);
+      XFillRectangle(osd->display, osd->line_bitmap, osd->gc, 0,
+                     y, osd->width, osd->line_height);
+#endif
+#ifdef HAVE_XFT
+      if (osd->image) {
+        if ((osd->update & UPD_mask) && !delta)
+          image_clear_mask(osd, line);
+      } else
+#endif
+      if ((osd->update & UPD_mask) && !delta) {
+        XFillRectangle(osd->display, osd->mask_bitmap, osd->mask_gc_back, 0,
+                       y, osd->width, osd->line_height);
+      }
+      switch (l->type) {
+      case LINE_text:
+        draw_text(osd, line);
+        break;
+      case LINE_percentage:
+      case LINE_slider:
+        draw_bar(osd, line);
+      case LINE_blank:
+        break;
+      }
+    }
+#ifdef HAVE_XFT
+    if (osd->image && osd->line_image)
+      image_upload(osd);
+#endif
+    osd->stats.frames++;
+    events |= XOSD_event_frame;
+  }
+  if (osd->update & (UPD_scroll | UPD_mask | UPD_lines))
+    stage_done(osd, XOSD_stage_lines, start);
+#ifndef DEBUG_XSHAPE
+  /* More than colours was changed, also update XShape. */
+  if (osd->update & UPD_mask) {
+    DEBUG(Dupdate, "UPD_mask");
+    start = _xosd_clock_ns();
+    update_shape(osd, osd->update & UPD_width);
+    stage_done(osd, XOSD_stage_mask, start);
+  }
+#endif
+  /* Show display requested. */
+  if (osd->update & UPD_show) {
+    DEBUG(Dupdate, "UPD_show");
+    if (~osd->generation & 1) {
+      osd->generation++;
+      osd->no_font = 0;
+      XMapRaised(osd->display, osd->window);
+      events |= XOSD_event_show;
+    }
+  }
+  /* Copy content, if window was changed, exposed or scrolled. Content
+   * changes only copy the bands of the dirty lines, merging adjacent ones. */
+  start = _xosd_clock_ns();
+  if ((osd->generation & 1)
+      && osd->update & (UPD_width | UPD_pos | UPD_show | UPD_scroll)) {
+    DEBUG(Dupdate, "UPD_copy");
+    XCopyArea(osd->display, osd->line_bitmap, osd->window, osd->gc, 0, 0,
+              osd->width, osd->height, 0, 0);
+  } else if ((osd->generation & 1) && osd->update & UPD_lines) {
+    DEBUG(Dupdate, "UPD_copy dirty");
+    for (line = 0; line < osd->number_lines; line++) {
+      int first = line;
+      if (!DIRTY_ISSET(osd, line))
+        continue;
+      while (line + 1 < osd->number_lines && DIRTY_ISSET(osd, line + 1))
+        line++;
+      XCopyArea(osd->display, osd->line_bitmap, osd->window, osd->gc,
+                0, osd->line_height * first, osd->width,
+                osd->line_height * (line - first + 1),
+                0, osd->line_height * first);
+    }
+  }
+  if ((osd->generation & 1)
+      && osd->update & (UPD_width | UPD_pos | UPD_show | UPD_scroll
+                        | UPD_lines))
+    stage_done(osd, XOSD_stage_copy, start);
+  if (osd->update & (UPD_mask | UPD_lines))
+    DIRTY_CLEAR(osd);
+  /* Ask the window manager to keep the window on top only once the first
+   * frame was sent, since probing it needs round trips. */
+  if ((osd->generation & 1) && !osd->on_top) {
+    stay_on_top(osd);
+    osd->on_top = 1;
+  }
+  /* Flush all pennding X11 requests, if any. */
+  if (osd->update & ~UPD_timer) {
+    start = _xosd_clock_ns();
+    XFlush(osd->display);
+    stage_done(osd, XOSD_stage_flush, start);
+    osd->update &= UPD_timer;
+  }
+  post_event(osd, events);
+  /* Restart the timer when requested. */
+  if (osd->update & UPD_timer) {
+    DEBUG(Dupdate, "UPD_timer");
+    osd->update = UPD_none;
+    if ((osd->generation & 1) && (osd->timeout > 0))
+      _xosd_timer_set(osd, osd->timeout);
+    else
+      _xosd_timer_set(osd, -1);
+  }
+  FUNCTION_END(Dfunction);
+}
+
+/* }}} */
+
+/* Handle one X11 event. {{{ */
+static void
+handle_event(xosd_context * ctx, XEvent * report)
+{
+  xosd *osd;
+
+#ifdef USE_XSHM
+  /* The server is done reading line_image, see image_upload(). */
+  for (osd = ctx->osds; osd; osd = osd->next)
+    if (osd->shm_busy != None && report->type == osd->shm_completion
+        && ((XShmCompletionEvent *) report)->drawable == osd->shm_busy) {
+      osd->shm_busy = None;
+      return;
+    }
+#endif
+  for (osd = ctx->osds; osd; osd = osd->next)
+    if (osd->window == report->xany.window)
+      break;
+  if (osd == NULL) {
+    DEBUG(Dvalue, "XEvent=%d for unknown window", report->type);
+    return;
+  }
+  /* ignore sent by server/manual send flag */
+  switch (report->type & 0x7f) {
+  case Expose:
+    {
+      XExposeEvent *XE = &report->xexpose;
+      /* http://x.holovko.ru/Xlib/chap10.html#10.9.1 */
+      DEBUG(Dvalue, "expose %d: x=%d y=%d w=%d h=%d", XE->count,
+            XE->x, XE->y, XE->width, XE->height);
+      osd->stats.expose_events++;
+      XCopyArea(osd->display, osd->line_bitmap, osd->window, osd->gc,
+                XE->x, XE->y, XE->width, XE->height, XE->x, XE->y);
+      break;
+    }
+  case GraphicsExpose:
+    {
+      XGraphicsExposeEvent *XE = &report->xgraphicsexpose;
+      DEBUG(Dvalue, "gfxexpose %d: x=%d y=%d w=%d h=%d code=%d",
+            XE->count, XE->x, XE->y, XE->width, XE->height, XE->major_code);
+      break;
+    }
+  case NoExpose:
+    {
+      XNoExposeEvent *XE = &report->xnoexpose;
+      DEBUG(Dvalue, "noexpose: code=%d", XE->major_code);
+      break;
+    }
+  default:
+    DEBUG(Dvalue, "XEvent=%d", report->type);
+    break;
+  }
+}
+
+/* }}} */
+
+/* Attach and detach objects of a context. {{{
+ * X11 resources of an object are created and freed by the event-thread,
+ * because it is the only one using the connection. */
+static int xosd_setup(xosd * osd);
+static void xosd_teardown(xosd * osd);
+
+/* Set up the objects waiting in context->attach. */
+static void
+attach_objects(xosd_context * ctx)
+{
+  xosd *osd, *next;
+
+  FUNCTION_START(Dfunction);
+  pthread_mutex_lock(&ctx->mutex_sync);
+  osd = ctx->attach;
+  ctx->attach = NULL;
+  pthread_mutex_unlock(&ctx->mutex_sync);
+
+  for (; osd; osd = next) {
+    int ret = xosd_setup(osd);
+    next = osd->next;
+    pthread_mutex_lock(&ctx->mutex_sync);
+    if (ret == 0) {
+      osd->next = ctx->osds;
+      ctx->osds = osd;
+      osd->attached = 1;
+    } else
+      osd->attached = -1;
+    pthread_cond_broadcast(&ctx->cond_sync);
+    pthread_mutex_unlock(&ctx->mutex_sync);
+  }
+}
+/* Release the X11 resources of osd after CMD_quit. The object must not be
+ * touched after detached is set, since xosd_destroy() frees it then. */
+static void
+detach_object(xosd_context * ctx, xosd * osd)
+{
+  xosd **prev;
+
+  FUNCTION_START(Dfunction);
+  for (prev = &ctx->osds; *prev != osd; prev = &(*prev)->next);
+  *prev = osd->next;
+  xosd_teardown(osd);
+
+  pthread_mutex_lock(&ctx->mutex_sync);
+  osd->detached = 1;
+  pthread_cond_broadcast(&ctx->cond_sync);
+  pthread_mutex_unlock(&ctx->mutex_sync);
+}
+
+/* }}} */
+
+/* Print the counters of all objects when the next dump is due. Return the
+ * time left until the next one in tv. */
+static void
+stats_dump(xosd_context * ctx, struct timeval *tv)
+{
+  struct timespec now;
+  long nsec;
+  xosd *osd;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  tv->tv_sec = ctx->stats_next.tv_sec - now.tv_sec;
+  nsec = ctx->stats_next.tv_nsec - now.tv_nsec;
+  if (nsec < 0) {
+    nsec += 1000000000L;
+    tv->tv_sec -= 1;
+  }
+  if (tv->tv_sec > 0 || (tv->tv_sec == 0 && nsec > 0)) {
+    tv->tv_usec = (nsec + 999) / 1000;
+    if (tv->tv_usec == 1000000) {
+      tv->tv_usec = 0;
+      tv->tv_sec += 1;
+    }
+    return;
+  }
+  for (osd = ctx->osds; osd; osd = osd->next) {
+    struct xosd_stats st;
+    xosd_get_stats(osd, &st);
+    stats_print(osd, &st);
+  }
+  ctx->stats_next = now;
+  ctx->stats_next.tv_sec += ctx->stats_interval;
+  tv->tv_sec = ctx->stats_interval;
+  tv->tv_usec = 0;
+}
+
+/* Handles X11 events, API commands and timeouts. {{{
+ * dispatch() does all work pending for a context without blocking, wait_fds()
+ * blocks until there is new work. The event-thread alternates between both,
+ * without it the application calls xosd_dispatch() from its own poll loop.
+ */
+
+/* Apply all posted commands, hide expired displays and handle the queued X11
+ * events. Return the time until the next deadline select() has to wake up
+ * for in tv, or NULL if the descriptors cover all of them. */
+static struct timeval *
+dispatch(xosd_context * ctx, struct timeval *tv)
+{
+  xosd *osd, *next_osd;
+  struct timeval left, *tvp;
+  int expired;
+
+  FUNCTION_START(Dfunction);
+  attach_objects(ctx);
+  do {
+    /* Apply all posted commands and draw them at once, unless a batch is
+     * still being collected. */
+    for (osd = ctx->osds; osd; osd = next_osd) {
+      next_osd = osd->next;
+      apply_commands(osd);
+      if (osd->done)
+        detach_object(ctx, osd);
+      else if (!osd->batch)
+        update_display(osd);
+    }
+
+    /* Calculate timeout delta or hide displays. */
+    expired = 0;
+    tvp = NULL;
+    for (osd = ctx->osds; osd; osd = osd->next)
+      switch (_xosd_timer_left(osd, &left)) {
+      case 0:
+        _xosd_timer_set(osd, -1);
+        if (osd->generation & 1)
+          osd->update |= UPD_hide;
+        expired = 1;
+        break;
+      case 1:
+        if (tvp == NULL || timercmp(&left, tvp, <)) {
+          *tv = left;
+          tvp = tv;
+        }
+        break;
+      }
+  } while (expired);            /* Hide the window first */
+  _xosd_timer_arm(ctx);
+  if (ctx->timerfd != -1)
+    tvp = NULL;
+  /* Dump statistics periodically, if requested by XOSD_STATS. */
+  if (ctx->stats_interval) {
+    stats_dump(ctx, &left);
+    if (tvp == NULL || timercmp(&left, tvp, <)) {
+      *tv = left;
+      tvp = tv;
+    }
+  }
+
+  /* Signal update and completion of all commands applied so far. The
+   * barrier orders these stores and those of the generation before
+   * reading waiters, as waiters increment it before reading them. */
+  for (osd = ctx->osds; osd; osd = osd->next)
+    if (osd->seq_applied == osd->seq_max)
+      osd->seq_done = osd->seq_max;
+  __sync_synchronize();
+  if (ctx->waiters) {
+    pthread_mutex_lock(&ctx->mutex_sync);
+    pthread_cond_broadcast(&ctx->cond_sync);
+    pthread_mutex_unlock(&ctx->mutex_sync);
+  }
+
+  /* There might be events which are not Exposure-events, so don't use
+   * XWindowEvent(). XPending() reads without blocking and also returns
+   * those Xlib has already read while waiting for a reply. */
+  while (XPending(ctx->display)) {
+    XEvent report;
+    XNextEvent(ctx->display, &report);
+    handle_event(ctx, &report);
+  }
+
+  /* Remember the deadline for xosd_next_timeout(). */
+  if (!ctx->threaded) {
+    if (tvp) {
+      clock_gettime(CLOCK_MONOTONIC, &ctx->deadline);
+      ctx->deadline.tv_sec += tvp->tv_sec;
+      ctx->deadline.tv_nsec += tvp->tv_usec * 1000;
+      if (ctx->deadline.tv_nsec >= 1000000000L) {
+        ctx->deadline.tv_nsec -= 1000000000L;
+        ctx->deadline.tv_sec += 1;
+      }
+    } else
+      ctx->deadline.tv_sec = ctx->deadline.tv_nsec = 0;
+  }
+  return tvp;
+}
+
+/* Wait for the next X11 event, API command or deadline, at most for tvp.
+ * Return -1 if the connection can not be waited for any more. */
+static int
+wait_fds(xosd_context * ctx, struct timeval *tvp)
+{
+  int retval, xfd, max;
+  fd_set readfds;
+
+  xfd = ConnectionNumber(ctx->display);
+  max = (ctx->wakefd[0] > xfd) ? ctx->wakefd[0] : xfd;
+  if (ctx->timerfd > max)
+    max = ctx->timerfd;
+
+  FD_ZERO(&readfds);
+  FD_SET(xfd, &readfds);
+  FD_SET(ctx->wakefd[0], &readfds);
+  if (ctx->timerfd != -1)
+    FD_SET(ctx->timerfd, &readfds);
+
+  retval = select(max + 1, &readfds, NULL, NULL, tvp);
+  DEBUG(Dvalue, "SELECT=%d WAKE=%d X11=%d", retval,
+        FD_ISSET(ctx->wakefd[0], &readfds), FD_ISSET(xfd, &readfds));
+
+  if (retval == -1 && errno == EINTR) {
+    DEBUG(Dselect, "select() EINTR");
+    return 0;
+  } else if (retval == -1) {
+    DEBUG(Dselect, "select() error %d", errno);
+    return -1;
+  } else if (retval == 0) {
+    DEBUG(Dselect, "select() timeout");
+    ctx->select_timeouts++;
+    return 0;
+  }
+  if (FD_ISSET(ctx->wakefd[0], &readfds)) {
+    /* Commands were posted, they are applied by the next dispatch(). */
+    ctx->wakeups++;
+    _xosd_notify_drain(ctx->wakefd);
+  }
+  if (ctx->timerfd != -1 && FD_ISSET(ctx->timerfd, &readfds))
+    /* The deadlines are checked again by the next dispatch(). */
+    _xosd_timer_drain(ctx);
+  /* X11 events are read by the next dispatch(). */
+  return 0;
+}
+
+/* This is running in it's own thread, which is the only one using X11.
+ * One thread serves all objects of its context. */
+static void *
+event_loop(void *ctxv)
+{
+  xosd_context *ctx = ctxv;
+  xosd *osd;
+
+  FUNCTION_START(Dfunction);
+  DEBUG(Dtrace, "event thread started");
+  assert(ctx);
+
+  while (!ctx->done) {
+    struct timeval tv, *tvp;
+
+    tvp = dispatch(ctx, &tv);
+    if (ctx->done)
+      break;
+    if (wait_fds(ctx, tvp) == -1)
+      ctx->done = 1;
+  }
+
+  /* Release all threads still waiting for their objects. Their X11
+   * resources are lost with the connection, their cached fontsets are freed
+   * by xosd_context_destroy(). */
+  pthread_mutex_lock(&ctx->mutex_sync);
+  for (osd = ctx->osds; osd; osd = osd->next)
+    osd->detached = 1;
+  for (osd = ctx->attach; osd; osd = osd->next)
+    osd->attached = -1;
+  ctx->attach = NULL;
+  pthread_cond_broadcast(&ctx->cond_sync);
+  pthread_mutex_unlock(&ctx->mutex_sync);
+
+  return NULL;
+}
+
+/* }}} */
+
+/* xosd_init -- Create a new xosd "object" {{{
+ * Deprecated: Use xosd_create. */
+xosd *
+xosd_init(const char *font, const char *colour, int timeout, xosd_pos pos,
+          int voffset, int shadow_offset, int number_lines)
 {
-  Atom gnome, net_wm, type;
-  int format;
-  unsigned long nitems, bytesafter;
-  unsigned char *args = NULL;
-  Window root = DefaultRootWindow(dpy);
+  xosd *osd = xosd_create(number_lines);
 
   FUNCTION_START(Dfunction);
-  /*
-   * build atoms 
-   */
-  gnome = XInternAtom(dpy, "_WIN_SUPPORTING_WM_CHECK", False);
-  net_wm = XInternAtom(dpy, "_NET_SUPPORTED", False);
+  if (osd == NULL)
+    return NULL;
 
-  /*
-   * gnome-compilant 
-   * tested with icewm + WindowMaker 
-   */
-  if (Success == XGetWindowProperty
-      (dpy, root, gnome, 0, (65536 / sizeof(long)), False,
-       AnyPropertyType, &type, &format, &nitems, &bytesafter, &args) &&
-      nitems > 0) {
+  if (xosd_set_font(osd, font) == -1) {
+    xosd_destroy(osd);
     /*
-     * FIXME: check capabilities 
+     * we do not set xosd_error, as set_font has already set it to 
+     * a sensible error message. 
      */
-    XClientMessageEvent xev;
-    Atom gnome_layer = XInternAtom(dpy, "_WIN_LAYER", False);
+    return NULL;
+  }
+  xosd_set_colour(osd, colour);
+  xosd_set_timeout(osd, timeout);
+  xosd_set_pos(osd, pos);
+  xosd_set_vertical_offset(osd, voffset);
+  xosd_set_shadow_offset(osd, shadow_offset);
 
-    memset(&xev, 0, sizeof(xev));
-    xev.type = ClientMessage;
-    xev.window = win;
-    xev.message_type = gnome_layer;
-    xev.format = 32;
-    xev.data.l[0] = 6 /* WIN_LAYER_ONTOP */ ;
+  return osd;
+}
 
-    XSendEvent(dpy, DefaultRootWindow(dpy), False, SubstructureNotifyMask,
-               (XEvent *) & xev);
-    XFree(args);
+/* }}} */
+
+/* Create a context, with an event-thread if threaded. {{{ */
+static xosd_context *
+context_create(int threaded)
+{
+  xosd_context *ctx;
+  char *display, *stats;
+
+  FUNCTION_START(Dfunction);
+  DEBUG(Dtrace, "getting display");
+  display = getenv("DISPLAY");
+  if (!display) {
+    xosd_error = "No display";
+    return NULL;
   }
-  /*
-   * netwm compliant.
-   * tested with kde 
-   */
-  else if (Success == XGetWindowProperty
-           (dpy, root, net_wm, 0, (65536 / sizeof(long)), False,
-            AnyPropertyType, &type, &format, &nitems, &bytesafter, &args)
-           && nitems > 0) {
-    XEvent e;
-    Atom net_wm_state = XInternAtom(dpy, "_NET_WM_STATE", False);
-    Atom net_wm_top = XInternAtom(dpy, "_NET_WM_STATE_STAYS_ON_TOP", False);
 
-    memset(&e, 0, sizeof(e));
-    e.xclient.type = ClientMessage;
-    e.xclient.message_type = net_wm_state;
-    e.xclient.display = dpy;
-    e.xclient.window = win;
-    e.xclient.format = 32;
-    e.xclient.data.l[0] = 1 /* _NET_WM_STATE_ADD */ ;
-    e.xclient.data.l[1] = net_wm_top;
-    e.xclient.data.l[2] = 0l;
-    e.xclient.data.l[3] = 0l;
-    e.xclient.data.l[4] = 0l;
+  DEBUG(Dtrace, "Mallocing context");
+  ctx = calloc(1, sizeof(xosd_context));
+  if (ctx == NULL) {
+    xosd_error = "Out of memory";
+    goto error0;
+  }
+
+  DEBUG(Dtrace, "Creating wakeup channel");
+  if (_xosd_notify_open(ctx->wakefd) == -1) {
+    xosd_error = "Error creating wakeup channel";
+    goto error0b;
+  }
+  if (_xosd_timer_open(ctx) == -1) {
+    xosd_error = "Error creating timer";
+    goto error0c;
+  }
+
+  DEBUG(Dtrace, "initializing mutex and condition");
+  pthread_mutex_init(&ctx->mutex_sync, NULL);
+  pthread_cond_init(&ctx->cond_sync, NULL);
+
+  stats = getenv("XOSD_STATS");
+  if (stats && atoi(stats) > 0) {
+    ctx->stats_interval = atoi(stats);
+    clock_gettime(CLOCK_MONOTONIC, &ctx->stats_next);
+    ctx->stats_next.tv_sec += ctx->stats_interval;
+  }
+
+  DEBUG(Dtrace, "Display query");
+  ctx->display = XOpenDisplay(display);
+  if (!ctx->display) {
+    xosd_error = "Cannot open display";
+    goto error1;
+  }
+
+  ctx->threaded = threaded;
+  if (!threaded)
+    return ctx;
+  DEBUG(Dtrace, "initializing event thread");
+  if (pthread_create(&ctx->event_thread, NULL, event_loop, ctx) != 0) {
+    xosd_error = "Cannot create event thread";
+    goto error2;
+  }
+  return ctx;
+
+error2:
+  XCloseDisplay(ctx->display);
+error1:
+  pthread_cond_destroy(&ctx->cond_sync);
+  pthread_mutex_destroy(&ctx->mutex_sync);
+  _xosd_timer_close(ctx);
+error0c:
+  _xosd_notify_close(ctx->wakefd);
+error0b:
+  free(ctx);
+error0:
+  return NULL;
+}
+
+/* }}} */
+
+/* xosd_context_create -- Create a context for several xosd "objects" {{{ */
+xosd_context *
+xosd_context_create(void)
+{
+  FUNCTION_START(Dfunction);
+  return context_create(1);
+}
+
+/* }}} */
+
+/* Create the X11 resources of a new object in the event-thread. {{{ */
+static int
+xosd_setup(xosd * osd)
+{
+  int event_basep, error_basep;
+#ifdef HAVE_XFT
+  char *render;
+#endif
+  XSetWindowAttributes setwinattr;
+  XGCValues xgcv = { .graphics_exposures = False };
+#ifdef HAVE_XINERAMA
+  int screens;
+  int dummy_a, dummy_b;
+  XineramaScreenInfo *screeninfo = NULL;
+#endif
+
+  FUNCTION_START(Dfunction);
+  osd->screen = XDefaultScreen(osd->display);
+
+  DEBUG(Dtrace, "x shape extension query");
+  if (!XShapeQueryExtension(osd->display, &event_basep, &error_basep)) {
+    xosd_error = "X-Server does not support shape extension";
+    return -1;
+  }
+
+  osd->visual = DefaultVisual(osd->display, osd->screen);
+  osd->depth = DefaultDepth(osd->display, osd->screen);
+
+#ifdef HAVE_XFT
+  DEBUG(Dtrace, "render backend selection");
+  render = getenv("XOSD_RENDER");
+  osd->image = render && strcmp(render, "image") == 0;
+  /* Core fonts stay the default, XLFD names of existing users keep working. */
+  osd->xft = osd->image || (render && strcmp(render, "xft") == 0
+                            && XftDefaultHasRender(osd->display));
+#endif
+#ifdef USE_XSHM
+  osd->shm = osd->image && XShmQueryExtension(osd->display);
+  if (osd->shm)
+    osd->shm_completion = XShmGetEventBase(osd->display) + ShmCompletion;
+#endif
+
+  DEBUG(Dtrace, "width and height initialization");
+#ifdef HAVE_XINERAMA
+  /* Only ask for the screens when they are used. */
+  if (XineramaQueryExtension(osd->display, &dummy_a, &dummy_b) &&
+      XineramaIsActive(osd->display) &&
+      (screeninfo = XineramaQueryScreens(osd->display, &screens))) {
+    osd->screen_width = screeninfo[0].width;
+    osd->screen_height = screeninfo[0].height;
+    osd->screen_xpos = screeninfo[0].x_org;
+  } else
+#endif
+  {
+    osd->screen_width = XDisplayWidth(osd->display, osd->screen);
+    osd->screen_height = XDisplayHeight(osd->display, osd->screen);
+    osd->screen_xpos = 0;
+  }
+#ifdef HAVE_XINERAMA
+  if (screeninfo)
+    XFree(screeninfo);
+#endif
+  osd->line_height = 10 /*Dummy value */ ;
+  osd->height = osd->line_height * osd->number_lines;
+  osd->width = 1;               /* Resized to the content when drawn */
+
+  DEBUG(Dtrace, "creating X Window");
+  setwinattr.override_redirect = 1;
+
+  osd->window = XCreateWindow(osd->display,
+                              XRootWindow(osd->display, osd->screen),
+                              0, 0,
+                              osd->width, osd->height,
+                              0,
+                              osd->depth,
+                              CopyFromParent,
+                              osd->visual, CWOverrideRedirect, &setwinattr);
+  XStoreName(osd->display, osd->window, "XOSD");
+
+  osd->mask_bitmap =
+    XCreatePixmap(osd->display, osd->window, osd->width,
+                  osd->height, 1);
+  osd->line_bitmap =
+    XCreatePixmap(osd->display, osd->window, osd->width,
+                  osd->line_height, osd->depth);
+  osd->band_bitmap =
+    XCreatePixmap(osd->display, osd->window, osd->width,
+                  osd->line_height, 1);
+  osd->glyph_bitmap =
+    XCreatePixmap(osd->display, osd->window, osd->width,
+                  osd->line_height, 1);
+  osd->outline_bitmap =
+    XCreatePixmap(osd->display, osd->window, osd->width,
+                  osd->line_height, 1);
+#ifdef HAVE_XFT
+  if (osd->image)
+    osd->cache_size = 0;
+  else if (osd->xft) {
+    osd->xft_line = XftDrawCreate(osd->display, osd->line_bitmap,
+                                  osd->visual,
+                                  DefaultColormap(osd->display, osd->screen));
+    osd->xft_glyph = XftDrawCreateBitmap(osd->display, osd->glyph_bitmap);
+  }
+#endif
+
+  osd->gc = XCreateGC(osd->display, osd->window, GCGraphicsExposures, &xgcv);
+  osd->mask_gc = XCreateGC(osd->display, osd->mask_bitmap, GCGraphicsExposures, &xgcv);
+  osd->mask_gc_back = XCreateGC(osd->display, osd->mask_bitmap, GCGraphicsExposures, &xgcv);
+  xgcv.function = GXor;
+  osd->mask_gc_or = XCreateGC(osd->display, osd->mask_bitmap, GCGraphicsExposures | GCFunction, &xgcv);
+
+  XSetBackground(osd->display, osd->gc,
+                 WhitePixel(osd->display, osd->screen));
+
+  XSetForeground(osd->display, osd->mask_gc_back,
+                 BlackPixel(osd->display, osd->screen));
+  XSetBackground(osd->display, osd->mask_gc_back,
+                 WhitePixel(osd->display, osd->screen));
+
+  XSetForeground(osd->display, osd->mask_gc,
+                 WhitePixel(osd->display, osd->screen));
+  XSetBackground(osd->display, osd->mask_gc,
+                 BlackPixel(osd->display, osd->screen));
+
+
+  DEBUG(Dtrace, "setting colour");
+  parse_colour(osd, &osd->colour, &osd->pixel, osd_default_colour);
+  /* Published to the creating thread by attach_objects(). */
+  osd->set_colour = osd->colour;
+
+  DEBUG(Dtrace, "Request exposure events");
+  XSelectInput(osd->display, osd->window, ExposureMask);
+  osd->update |= UPD_size | UPD_pos | UPD_mask;
+  return 0;
+}
+
+/* }}} */
+
+/* xosd_create_in_context -- Create a new xosd "object" in a context {{{ */
+xosd *
+xosd_create_in_context(xosd_context * ctx, int number_lines)
+{
+  xosd *osd;
+
+  FUNCTION_START(Dfunction);
+  if (ctx == NULL || number_lines <= 0) {
+    xosd_error = "Invalid argument";
+    return NULL;
+  }
+
+  DEBUG(Dtrace, "Mallocing osd");
+  osd = calloc(1, sizeof(xosd));
+  if (osd == NULL) {
+    xosd_error = "Out of memory";
+    goto error0;
+  }
+
+  DEBUG(Dtrace, "initializing mutex");
+  pthread_mutex_init(&osd->mutex_batch, NULL);
+  pthread_mutex_init(&osd->mutex_pool, NULL);
+
+  DEBUG(Dtrace, "initializing number lines");
+  osd->number_lines = number_lines;
+  osd->lines = calloc(osd->number_lines, sizeof(union xosd_line));
+  if (osd->lines == NULL) {
+    xosd_error = "Out of memory";
+    goto error1;
+  }
+
+  osd->dirty = calloc(DIRTY_WORDS(osd->number_lines), sizeof(unsigned long));
+  osd->line_bufs = calloc(osd->number_lines, sizeof(struct xosd_buf));
+  if (osd->dirty == NULL || osd->line_bufs == NULL) {
+    xosd_error = "Out of memory";
+    goto error2;
+  }
+
+  DEBUG(Dtrace, "misc osd variable initialization");
+  osd->context = ctx;
+  osd->display = ctx->display;
+  osd->generation = 0;
+  osd->done = 0;
+  osd->pos = XOSD_top;
+  osd->hoffset = 0;
+  osd->align = XOSD_left;
+  osd->voffset = 0;
+  osd->timeout = -1;
+  osd->cache_size = XOSD_CACHE_SIZE;
+  osd->fontset = NULL;
+  osd->bar_length = -1;         /* old automatic width calculation */
+
+  DEBUG(Dtrace, "attaching to context");
+  __sync_add_and_fetch(&ctx->users, 1);
+  pthread_mutex_lock(&ctx->mutex_sync);
+  osd->next = ctx->attach;
+  ctx->attach = osd;
+  _xosd_wakeup(ctx);
+  if (!ctx->threaded) {
+    pthread_mutex_unlock(&ctx->mutex_sync);
+    _xosd_run(ctx);
+    pthread_mutex_lock(&ctx->mutex_sync);
+  }
+  while (osd->attached == 0)
+    pthread_cond_wait(&ctx->cond_sync, &ctx->mutex_sync);
+  pthread_mutex_unlock(&ctx->mutex_sync);
+  if (osd->attached == -1) {
+    /* xosd_error was set by the event-thread. */
+    __sync_sub_and_fetch(&ctx->users, 1);
+    goto error2;
+  }
+  return osd;
+
+error2:
+  free(osd->line_bufs);
+  free(osd->dirty);
+  free(osd->lines);
+error1:
+  pthread_mutex_destroy(&osd->mutex_pool);
+  pthread_mutex_destroy(&osd->mutex_batch);
+  free(osd);
+error0:
+  return NULL;
+}
+
+/* }}} */
+
+/* xosd_create -- Create a new xosd "object" {{{
+ * The object gets a context of its own. */
+static xosd *
+create_own(int number_lines, int threaded)
+{
+  xosd_context *ctx;
+  xosd *osd;
+
+  FUNCTION_START(Dfunction);
+  ctx = context_create(threaded);
+  if (ctx == NULL)
+    return NULL;
+  osd = xosd_create_in_context(ctx, number_lines);
+  if (osd == NULL) {
+    char *error = xosd_error;
+    xosd_context_destroy(ctx);
+    xosd_error = error;
+    return NULL;
+  }
+  osd->own_context = 1;
+  return osd;
+}
+
+xosd *
+xosd_create(int number_lines)
+{
+  return create_own(number_lines, 1);
+}
+
+/* }}} */
+
+/* xosd_create_unthreaded -- Create a new xosd "object" without thread {{{
+ * The application drives it by xosd_dispatch() instead of an event-thread. */
+xosd *
+xosd_create_unthreaded(int number_lines)
+{
+  return create_own(number_lines, 0);
+}
+
+/* }}} */
+
+/* xosd_uninit -- Destroy a xosd "object" {{{
+ * Deprecated: Use xosd_destroy. */
+int
+xosd_uninit(xosd * osd)
+{
+  FUNCTION_START(Dfunction);
+  return xosd_destroy(osd);
+}
+
+/* }}} */
 
-    XSendEvent(dpy, DefaultRootWindow(dpy), False,
-               SubstructureRedirectMask, &e);
-    XFree(args);
-  }
-  XRaiseWindow(dpy, win);
+/* Free the X11 resources of an object in the event-thread. {{{ */
+static void
+xosd_teardown(xosd * osd)
+{
+  FUNCTION_START(Dfunction);
+  DEBUG(Dtrace, "freeing X resources");
+  cache_trim(osd, 0);
+  free(osd->cache_pool);
+  extents_flush(osd);
+  XFreeGC(osd->display, osd->gc);
+  XFreeGC(osd->display, osd->mask_gc);
+  XFreeGC(osd->display, osd->mask_gc_back);
+  XFreeGC(osd->display, osd->mask_gc_or);
+  XFreePixmap(osd->display, osd->line_bitmap);
+#ifdef HAVE_XFT
+  image_free(osd);
+  free(osd->ucs);
+  if (osd->xft) {
+    if (!osd->image) {
+      XftDrawDestroy(osd->xft_line);
+      XftDrawDestroy(osd->xft_glyph);
+    }
+    /* The default font is only loaded when the display is shown. */
+    if (osd->xftfont)
+      XftFontClose(osd->display, osd->xftfont);
+  } else
+#endif
+    fontset_put(osd->display, osd->fontset);    /* NULL if never shown */
+  XFreePixmap(osd->display, osd->mask_bitmap);
+  XFreePixmap(osd->display, osd->band_bitmap);
+  XFreePixmap(osd->display, osd->glyph_bitmap);
+  XFreePixmap(osd->display, osd->outline_bitmap);
+  XDestroyWindow(osd->display, osd->window);
+  XFlush(osd->display);
 }
 
 /* }}} */
 
-/* xosd_init -- Create a new xosd "object" {{{
- * Deprecated: Use xosd_create. */
-xosd *
-xosd_init(const char *font, const char *colour, int timeout, xosd_pos pos,
-          int voffset, int shadow_offset, int number_lines)
+/* xosd_destroy -- Destroy a xosd "object" {{{ */
+int
+xosd_destroy(xosd * osd)
 {
-  xosd *osd = xosd_create(number_lines);
+  int i;
+  xosd_context *ctx;
 
   FUNCTION_START(Dfunction);
   if (osd == NULL)
-    return NULL;
+    return -1;
+  ctx = osd->context;
 
-  if (xosd_set_font(osd, font) == -1) {
-    xosd_destroy(osd);
-    /*
-     * we do not set xosd_error, as set_font has already set it to 
-     * a sensible error message. 
-     */
-    return NULL;
+  DEBUG(Dtrace, "waiting for event thread to release object");
+  if (_xosd_in_batch(osd)) {
+    osd->batch = 1;             /* Also releases an unfinished batch. */
+    xosd_commit(osd);
   }
-  xosd_set_colour(osd, colour);
-  xosd_set_timeout(osd, timeout);
-  xosd_set_pos(osd, pos);
-  xosd_set_vertical_offset(osd, voffset);
-  xosd_set_shadow_offset(osd, shadow_offset);
+  if (_xosd_call(osd, CMD_quit, 0, NULL, POST_async) == -1)
+    return -1;
+  _xosd_run(ctx);
+  pthread_mutex_lock(&ctx->mutex_sync);
+  while (!osd->detached)
+    pthread_cond_wait(&ctx->cond_sync, &ctx->mutex_sync);
+  pthread_mutex_unlock(&ctx->mutex_sync);
 
-  return osd;
+  DEBUG(Dtrace, "freeing unprocessed and pooled commands");
+  _xosd_cmd_free(osd->queue);
+  _xosd_cmd_free(osd->cmd_pool);
+
+  DEBUG(Dtrace, "freeing lines");
+  for (i = 0; i < osd->number_lines; i++)
+    free(osd->line_bufs[i].data);
+  free(osd->line_bufs);
+  free(osd->lines);
+  free(osd->dirty);
+  free(osd->bar_rects);
+
+  if (osd->events_on)
+    _xosd_notify_close(osd->event_fd);
+
+  DEBUG(Dtrace, "destroying mutex");
+  pthread_mutex_destroy(&osd->mutex_pool);
+  pthread_mutex_destroy(&osd->mutex_batch);
+
+  __sync_sub_and_fetch(&ctx->users, 1);
+  if (osd->own_context)
+    xosd_context_destroy(ctx);
+
+  DEBUG(Dtrace, "freeing osd structure");
+  free(osd);
+
+  FUNCTION_END(Dfunction);
+  return 0;
 }
 
 /* }}} */
 
-/* xosd_create -- Create a new xosd "object" {{{ */
-xosd *
-xosd_create(int number_lines)
+/* xosd_context_destroy -- Destroy a context {{{ */
+int
+xosd_context_destroy(xosd_context * ctx)
 {
-  xosd *osd;
-  int event_basep, error_basep, i;
-  char *display;
-  XSetWindowAttributes setwinattr;
-  XGCValues xgcv = { .graphics_exposures = False };
-#ifdef HAVE_XINERAMA
-  int screens;
-  int dummy_a, dummy_b;
-  XineramaScreenInfo *screeninfo = NULL;
-#endif
-
   FUNCTION_START(Dfunction);
-  DEBUG(Dtrace, "getting display");
-  display = getenv("DISPLAY");
-  if (!display) {
-    xosd_error = "No display";
-    return NULL;
+  if (ctx == NULL)
+    return -1;
+  if (ctx->users > 0) {
+    xosd_error = "Context still in use";
+    return -1;
   }
 
-  DEBUG(Dtrace, "Mallocing osd");
-  osd = malloc(sizeof(xosd));
-  memset(osd, 0, sizeof(xosd));
-  if (osd == NULL) {
-    xosd_error = "Out of memory";
-    goto error0;
+  if (ctx->threaded) {
+    DEBUG(Dtrace, "join event thread");
+    __sync_lock_test_and_set(&ctx->done, 1);
+    _xosd_wakeup(ctx);
+    pthread_join(ctx->event_thread, NULL);
   }
 
-  DEBUG(Dtrace, "Creating pipe");
-  if (pipe(osd->pipefd) == -1) {
-    xosd_error = "Error creating pipe";
-    goto error0b;
+  fontset_forget(ctx->display);
+  XCloseDisplay(ctx->display);
+
+  DEBUG(Dtrace, "freeing colours");
+  while (ctx->colours) {
+    struct xosd_colour *c = ctx->colours;
+    ctx->colours = c->next;
+    free(c->name);
+    free(c);
   }
 
-  DEBUG(Dtrace, "initializing mutex");
-  pthread_mutex_init(&osd->mutex, NULL);
-  pthread_mutex_init(&osd->mutex_sync, NULL);
-  DEBUG(Dtrace, "initializing condition");
-  pthread_cond_init(&osd->cond_wait, NULL);
-  pthread_cond_init(&osd->cond_sync, NULL);
+  DEBUG(Dtrace, "destroying condition and mutex");
+  pthread_cond_destroy(&ctx->cond_sync);
+  pthread_mutex_destroy(&ctx->mutex_sync);
+  _xosd_timer_close(ctx);
+  _xosd_notify_close(ctx->wakefd);
+  free(ctx);
 
-  DEBUG(Dtrace, "initializing number lines");
-  osd->number_lines = number_lines;
-  osd->lines = malloc(sizeof(union xosd_line) * osd->number_lines);
-  if (osd->lines == NULL) {
-    xosd_error = "Out of memory";
-    goto error1;
-  }
+  FUNCTION_END(Dfunction);
+  return 0;
+}
 
-  for (i = 0; i < osd->number_lines; i++)
-    memset(&osd->lines[i], 0, sizeof(union xosd_line));
+/* }}} */
 
-  DEBUG(Dtrace, "misc osd variable initialization");
-  osd->generation = 0;
-  osd->done = 0;
-  osd->pos = XOSD_top;
-  osd->hoffset = 0;
-  osd->align = XOSD_left;
-  osd->voffset = 0;
-  osd->timeout = -1;
-  timerclear(&osd->timeout_start);
-  osd->fontset = NULL;
-  osd->bar_length = -1;         /* old automatic width calculation */
+/* xosd_set_bar_length  -- Set length of percentage and slider bar {{{ */
+int
+xosd_set_bar_length(xosd * osd, int length)
+{
+  FUNCTION_START(Dfunction);
+  if (osd == NULL)
+    return -1;
 
-  DEBUG(Dtrace, "Display query");
-  osd->display = XOpenDisplay(display);
-  if (!osd->display) {
-    xosd_error = "Cannot open display";
-    goto error2;
-  }
-  osd->screen = XDefaultScreen(osd->display);
+  if (length == 0)
+    return -1;
+  if (length < -1)
+    return -1;
 
-  DEBUG(Dtrace, "x shape extension query");
-  if (!XShapeQueryExtension(osd->display, &event_basep, &error_basep)) {
-    xosd_error = "X-Server does not support shape extension";
-    goto error3;
-  }
+  return _xosd_call(osd, CMD_bar_length, length, NULL, POST_async);
+}
 
-  osd->visual = DefaultVisual(osd->display, osd->screen);
-  osd->depth = DefaultDepth(osd->display, osd->screen);
+/* }}} */
 
-  DEBUG(Dtrace, "font selection info");
-  xosd_set_font(osd, osd_default_font);
-  if (osd->fontset == NULL) {
-    /*
-     * if we still don't have a fontset, then abort 
-     */
-    xosd_error = "Default font not found";
-    goto error3;
+/* Post new line content, return its sequence number in seq. {{{ */
+static int
+_xosd_display(xosd * osd, int line, xosd_command command, va_list a,
+              enum POST mode, unsigned long *seq)
+{
+  int ret = -1;
+  struct xosd_cmd *cmd;
+
+  FUNCTION_START(Dfunction);
+  if (osd == NULL)
+    return -1;
+
+  if (line < 0 || line >= osd->number_lines) {
+    xosd_error = "xosd_display: Invalid Line Number";
+    return -1;
   }
 
-  DEBUG(Dtrace, "width and height initialization");
-#ifdef HAVE_XINERAMA
-  if (XineramaQueryExtension(osd->display, &dummy_a, &dummy_b) &&
-      (screeninfo = XineramaQueryScreens(osd->display, &screens)) &&
-      XineramaIsActive(osd->display)) {
-    osd->screen_width = screeninfo[0].width;
-    osd->screen_height = screeninfo[0].height;
-    osd->screen_xpos = screeninfo[0].x_org;
-  } else
-#endif
-  {
-    osd->screen_width = XDisplayWidth(osd->display, osd->screen);
-    osd->screen_height = XDisplayHeight(osd->display, osd->screen);
-    osd->screen_xpos = 0;
+  cmd = _xosd_cmd_new(osd, CMD_display, line, NULL);
+  if (cmd == NULL)
+    return -1;
+
+  switch (command) {
+  case XOSD_string:
+  case XOSD_printf:
+  case XOSD_borrowed:
+    {
+      struct xosd_text *l = &cmd->line.text;
+      char *string = va_arg(a, char *);
+      char *text = NULL;
+      va_list b;
+      ret = 0;
+      if (string == NULL) {
+        /* blank line */
+      } else if (command == XOSD_borrowed) {
+        /* Used in place, the caller keeps it unchanged while displayed. */
+        cmd->borrowed = 1;
+        ret = strlen(string);
+        text = string;
+      } else if (command == XOSD_printf) {
+        /* Short text fits inline, longer text is formatted again into
+         * storage of the right size, which the pooled command keeps. */
+        va_copy(b, a);
+        ret = vsnprintf(cmd->inline_text, sizeof(cmd->inline_text), string, b);
+        va_end(b);
+        if (ret < 0) {
+          xosd_error = "xosd_display: Invalid format";
+          goto error;
+        }
+        text = _xosd_cmd_text(cmd, ret + 1);
+        if (text == NULL) {
+          ret = -1;
+          xosd_error = "Out of memory";
+          goto error;
+        }
+        if (text != cmd->inline_text)
+          vsnprintf(text, ret + 1, string, a);
+      } else {
+        ret = strlen(string);
+        text = _xosd_cmd_text(cmd, ret + 1);
+        if (text == NULL) {
+          ret = -1;
+          xosd_error = "Out of memory";
+          goto error;
+        }
+        memcpy(text, string, ret + 1);
+      }
+      if (ret > 0) {
+        l->type = LINE_text;
+        l->string = text;
+        l->length = ret;
+        l->hash = _xosd_hash(text);
+      } else {
+        l->type = LINE_blank;
+      }
+      l->width = -1;
+      break;
+    }
+
+  case XOSD_percentage:
+  case XOSD_slider:
+    {
+      struct xosd_bar *l = &cmd->line.bar;
+      ret = va_arg(a, int);
+      ret = (ret < 0) ? 0 : (ret > 100) ? 100 : ret;
+      l->type = (command == XOSD_percentage) ? LINE_percentage : LINE_slider;
+      l->value = ret;
+      l->drawn = -1;
+      break;
+    }
+
+  default:
+    {
+      xosd_error = "xosd_display: Unknown command";
+      goto error;
+    }
   }
-#ifdef HAVE_XINERAMA
-  if (screeninfo)
-    XFree(screeninfo);
-#endif
-  osd->line_height = 10 /*Dummy value */ ;
-  osd->height = osd->line_height * osd->number_lines;
 
-  DEBUG(Dtrace, "creating X Window");
-  setwinattr.override_redirect = 1;
+  *seq = _xosd_post(osd, cmd, mode);
+  return ret;
 
-  osd->window = XCreateWindow(osd->display,
-                              XRootWindow(osd->display, osd->screen),
-                              0, 0,
-                              osd->screen_width, osd->height,
-                              0,
-                              osd->depth,
-                              CopyFromParent,
-                              osd->visual, CWOverrideRedirect, &setwinattr);
-  XStoreName(osd->display, osd->window, "XOSD");
+error:
+  _xosd_cmd_put(osd, cmd, cmd);
+  return ret;
+}
 
-  osd->mask_bitmap =
-    XCreatePixmap(osd->display, osd->window, osd->screen_width,
-                  osd->height, 1);
-  osd->line_bitmap =
-    XCreatePixmap(osd->display, osd->window, osd->screen_width,
-                  osd->line_height, osd->depth);
+/* }}} */
 
-  osd->gc = XCreateGC(osd->display, osd->window, GCGraphicsExposures, &xgcv);
-  osd->mask_gc = XCreateGC(osd->display, osd->mask_bitmap, GCGraphicsExposures, &xgcv);
-  osd->mask_gc_back = XCreateGC(osd->display, osd->mask_bitmap, GCGraphicsExposures, &xgcv);
+/* xosd_display -- Display information {{{ */
+int
+xosd_display(xosd * osd, int line, xosd_command command, ...)
+{
+  int ret;
+  unsigned long seq;
+  va_list a;
 
-  XSetBackground(osd->display, osd->gc,
-                 WhitePixel(osd->display, osd->screen));
+  FUNCTION_START(Dfunction);
+  va_start(a, command);
+  ret = _xosd_display(osd, line, command, a, POST_show, &seq);
+  va_end(a);
+  if (ret != -1 && _xosd_show_failed(osd))
+    return -1;
+  return ret;
+}
 
-  XSetForeground(osd->display, osd->mask_gc_back,
-                 BlackPixel(osd->display, osd->screen));
-  XSetBackground(osd->display, osd->mask_gc_back,
-                 WhitePixel(osd->display, osd->screen));
+/* }}} */
+
+/* xosd_display_async -- Display information without waiting {{{ */
+long
+xosd_display_async(xosd * osd, int line, xosd_command command, ...)
+{
+  unsigned long seq = 0;
+  va_list a;
+
+  FUNCTION_START(Dfunction);
+  va_start(a, command);
+  if (_xosd_display(osd, line, command, a, POST_async, &seq) == -1)
+    seq = -1;
+  va_end(a);
+  return seq;
+}
 
-  XSetForeground(osd->display, osd->mask_gc,
-                 WhitePixel(osd->display, osd->screen));
-  XSetBackground(osd->display, osd->mask_gc,
-                 BlackPixel(osd->display, osd->screen));
+/* }}} */
 
+/* xosd_wait_ticket -- Wait until a command has been displayed {{{ */
+int
+xosd_wait_ticket(xosd * osd, long ticket)
+{
+  FUNCTION_START(Dfunction);
+  if (osd == NULL || ticket < 0)
+    return -1;
 
-  DEBUG(Dtrace, "setting colour");
-  xosd_set_colour(osd, osd_default_colour);
+  if (ticket > 0)
+    _xosd_wait_seq(osd, ticket);
+  return 0;
+}
 
-  DEBUG(Dtrace, "stay on top");
-  stay_on_top(osd->display, osd->window);
+/* }}} */
 
-  DEBUG(Dtrace, "initializing event thread");
-  pthread_create(&osd->event_thread, NULL, event_loop, osd);
+/* xosd_ticket_done -- Check if a command has been displayed {{{ */
+int
+xosd_ticket_done(xosd * osd, long ticket)
+{
+  int done;
 
-  return osd;
+  FUNCTION_START(Dfunction);
+  if (osd == NULL || ticket < 0)
+    return -1;
 
-error3:
-  XCloseDisplay(osd->display);
-error2:
-  free(osd->lines);
-error1:
-  pthread_cond_destroy(&osd->cond_sync);
-  pthread_cond_destroy(&osd->cond_wait);
-  pthread_mutex_destroy(&osd->mutex_sync);
-  pthread_mutex_destroy(&osd->mutex);
-  close(osd->pipefd[0]);
-  close(osd->pipefd[1]);
-error0b:
-  free(osd);
-error0:
-  return NULL;
+  pthread_mutex_lock(&osd->context->mutex_sync);
+  done = (long) (osd->seq_done - ticket) >= 0;
+  pthread_mutex_unlock(&osd->context->mutex_sync);
+  return done;
 }
 
 /* }}} */
 
-/* xosd_uninit -- Destroy a xosd "object" {{{
- * Deprecated: Use xosd_destroy. */
+/* xosd_set_async -- Never wait for the display to be mapped {{{ */
 int
-xosd_uninit(xosd * osd)
+xosd_set_async(xosd * osd, int async)
 {
   FUNCTION_START(Dfunction);
-  return xosd_destroy(osd);
+  if (osd == NULL)
+    return -1;
+
+  osd->async = async;
+  return 0;
 }
 
 /* }}} */
 
-/* xosd_destroy -- Destroy a xosd "object" {{{ */
+/* xosd_begin_update -- Start collecting updates into one batch {{{ */
 int
-xosd_destroy(xosd * osd)
+xosd_begin_update(xosd * osd)
 {
-  int i;
+  pthread_t self;
 
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
 
-  DEBUG(Dtrace, "waiting for threads to exit");
-  _xosd_lock(osd);
-  osd->done = 1;
-  _xosd_unlock(osd);
-
-  DEBUG(Dtrace, "join threads");
-  pthread_join(osd->event_thread, NULL);
+  if (_xosd_in_batch(osd)) {
+    osd->batch++;
+    return 0;
+  }
+  pthread_mutex_lock(&osd->mutex_batch);
+  self = pthread_self();
+  __atomic_store(&osd->batch_owner, &self, __ATOMIC_RELAXED);
+  osd->batch_wait = 0;
+  __atomic_store_n(&osd->batch, 1, __ATOMIC_RELEASE);
 
-  DEBUG(Dtrace, "freeing X resources");
-  XFreeGC(osd->display, osd->gc);
-  XFreeGC(osd->display, osd->mask_gc);
-  XFreeGC(osd->display, osd->mask_gc_back);
-  XFreePixmap(osd->display, osd->line_bitmap);
-  XFreeFontSet(osd->display, osd->fontset);
-  XFreePixmap(osd->display, osd->mask_bitmap);
-  XDestroyWindow(osd->display, osd->window);
+  return 0;
+}
 
-  XCloseDisplay(osd->display);
+/* }}} */
 
-  DEBUG(Dtrace, "freeing lines");
-  for (i = 0; i < osd->number_lines; i++)
-    if (osd->lines[i].type == LINE_text && osd->lines[i].text.string)
-      free(osd->lines[i].text.string);
-  free(osd->lines);
+/* xosd_commit -- Draw all updates collected since xosd_begin_update {{{ */
+int
+xosd_commit(xosd * osd)
+{
+  unsigned long seq;
+  int wait;
 
-  DEBUG(Dtrace, "destroying condition and mutex");
-  pthread_cond_destroy(&osd->cond_sync);
-  pthread_cond_destroy(&osd->cond_wait);
-  pthread_mutex_destroy(&osd->mutex_sync);
-  pthread_mutex_destroy(&osd->mutex);
-  close(osd->pipefd[0]);
-  close(osd->pipefd[1]);
+  FUNCTION_START(Dfunction);
+  if (osd == NULL)
+    return -1;
 
-  DEBUG(Dtrace, "freeing osd structure");
-  free(osd);
+  if (!_xosd_in_batch(osd)) {
+    xosd_error = "xosd_commit: No update in progress";
+    return -1;
+  }
+  if (osd->batch > 1) {
+    osd->batch--;
+    return 0;
+  }
+  /* Clear the flag first, so the event-thread draws after the wakeup. */
+  wait = osd->batch_wait;
+  __sync_lock_release(&osd->batch);
+  if (osd->batch_queue)
+    seq = _xosd_push_batch(osd);
+  else {
+    seq = osd->seq_posted;
+    _xosd_wakeup(osd->context); /* Draw what was deferred by the batch. */
+  }
+  pthread_mutex_unlock(&osd->mutex_batch);
+  if (wait) {
+    _xosd_wait_seq(osd, seq);
+    if (_xosd_show_failed(osd))
+      return -1;
+  }
 
-  FUNCTION_END(Dfunction);
   return 0;
 }
 
 /* }}} */
 
-/* xosd_set_bar_length  -- Set length of percentage and slider bar {{{ */
+/* xosd_is_onscreen -- Returns weather the display is show {{{ */
 int
-xosd_set_bar_length(xosd * osd, int length)
+xosd_is_onscreen(xosd * osd)
 {
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
+  return osd->generation & 1;
+}
 
-  if (length == 0)
-    return -1;
-  if (length < -1)
+/* }}} */
+
+/* xosd_get_event_fd -- Get a file descriptor signalling display events {{{ */
+int
+xosd_get_event_fd(xosd * osd)
+{
+  xosd_context *ctx;
+  int ret = 0;
+
+  FUNCTION_START(Dfunction);
+  if (osd == NULL)
     return -1;
+  ctx = osd->context;
+
+  pthread_mutex_lock(&ctx->mutex_sync);
+  if (!osd->events_on) {
+    ret = _xosd_notify_open(osd->event_fd);
+    if (ret != -1) {
+      /* The event-thread reads events_on without the lock. */
+      __sync_synchronize();
+      osd->events_on = 1;
+    } else
+      xosd_error = "Error creating event channel";
+  }
+  pthread_mutex_unlock(&ctx->mutex_sync);
+  return (ret == -1) ? -1 : osd->event_fd[0];
+}
 
-  osd->bar_length = length;
+/* }}} */
 
-  return 0;
+/* xosd_read_events -- Take the events signalled by xosd_get_event_fd {{{ */
+int
+xosd_read_events(xosd * osd)
+{
+  FUNCTION_START(Dfunction);
+  if (osd == NULL || !osd->events_on)
+    return -1;
+
+  /* Drain first, so events posted meanwhile signal the descriptor again or
+   * are taken below. */
+  _xosd_notify_drain(osd->event_fd);
+  return __sync_lock_test_and_set(&osd->events, 0);
 }
 
 /* }}} */
 
-/* xosd_display -- Display information {{{ */
+/* xosd_get_fds -- Get the file descriptors to poll for xosd_dispatch {{{ */
 int
-xosd_display(xosd * osd, int line, xosd_command command, ...)
+xosd_get_fds(xosd * osd, int *fds, int size)
 {
-  int ret = -1;
-union xosd_line newline = { type:LINE_blank };
-  va_list a;
+  xosd_context *ctx;
+  int n = 0;
 
   FUNCTION_START(Dfunction);
-  if (osd == NULL)
+  if (osd == NULL || fds == NULL)
     return -1;
-
-  if (line < 0 || line >= osd->number_lines) {
-    xosd_error = "xosd_display: Invalid Line Number";
+  ctx = osd->context;
+  if (size < ((ctx->timerfd != -1) ? 3 : 2)) {
+    xosd_error = "Invalid argument";
     return -1;
   }
 
-  va_start(a, command);
-  switch (command) {
-  case XOSD_string:
-  case XOSD_printf:
-    {
-      char buf[XOSD_MAX_PRINTF_BUF_SIZE];
-      struct xosd_text *l = &newline.text;
-      char *string = va_arg(a, char *);
-      if (command == XOSD_printf) {
-        if (vsnprintf(buf, sizeof(buf), string, a) >= sizeof(buf)) {
-          xosd_error = "xosd_display: Buffer too small";
-          goto error;
-        }
-        string = buf;
-      }
-      if (string && *string) {
-        ret = strlen(string);
-        l->type = LINE_text;
-        l->string = malloc(ret + 1);
-        memcpy(l->string, string, ret + 1);
-      } else {
-        ret = 0;
-        l->type = LINE_blank;
-      }
-      l->width = -1;
-      break;
-    }
+  fds[n++] = ConnectionNumber(ctx->display);
+  fds[n++] = ctx->wakefd[0];
+  if (ctx->timerfd != -1)
+    fds[n++] = ctx->timerfd;
+  return n;
+}
 
-  case XOSD_percentage:
-  case XOSD_slider:
-    {
-      struct xosd_bar *l = &newline.bar;
-      ret = va_arg(a, int);
-      ret = (ret < 0) ? 0 : (ret > 100) ? 100 : ret;
-      l->type = (command == XOSD_percentage) ? LINE_percentage : LINE_slider;
-      l->value = ret;
-      break;
-    }
+/* }}} */
 
-  default:
-    {
-      xosd_error = "xosd_display: Unknown command";
-      goto error;
-    }
-  }
+/* xosd_next_timeout -- Get the time until xosd_dispatch must be called {{{ */
+int
+xosd_next_timeout(xosd * osd)
+{
+  xosd_context *ctx;
+  struct timespec now;
+  long sec, nsec;
 
-  _xosd_lock(osd);
-  /* Free old entry */
-  switch (osd->lines[line].type) {
-  case LINE_text:
-    free(osd->lines[line].text.string);
-  case LINE_blank:
-  case LINE_percentage:
-  case LINE_slider:
-    break;
-  }
-  osd->lines[line] = newline;
-  osd->update |= UPD_content | UPD_timer | UPD_show;
-  _xosd_unlock(osd);
+  FUNCTION_START(Dfunction);
+  if (osd == NULL)
+    return -1;
+  ctx = osd->context;
+  if (ctx->deadline.tv_sec == 0 && ctx->deadline.tv_nsec == 0)
+    return -1;
 
-error:
-  va_end(a);
-  return ret;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sec = ctx->deadline.tv_sec - now.tv_sec;
+  nsec = ctx->deadline.tv_nsec - now.tv_nsec;
+  if (nsec < 0) {
+    nsec += 1000000000L;
+    sec -= 1;
+  }
+  if (sec < 0)
+    return 0;
+  return sec * 1000 + (nsec + 999999) / 1000000;
 }
 
 /* }}} */
 
-/* xosd_is_onscreen -- Returns weather the display is show {{{ */
+/* xosd_dispatch -- Handle pending work of an unthreaded object {{{ */
 int
-xosd_is_onscreen(xosd * osd)
+xosd_dispatch(xosd * osd)
 {
+  xosd_context *ctx;
+  struct timeval tv;
+
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
-  return osd->generation & 1;
+  ctx = osd->context;
+  if (ctx->threaded) {
+    xosd_error = "Object has an event thread";
+    return -1;
+  }
+
+  _xosd_notify_drain(ctx->wakefd);
+  if (ctx->timerfd != -1)
+    _xosd_timer_drain(ctx);
+  dispatch(ctx, &tv);
+  return 0;
 }
 
 /* }}} */
@@ -1029,18 +3893,11 @@ xosd_wait_until_no_display(xosd * osd)
 int
 xosd_set_colour(xosd * osd, const char *colour)
 {
-  int retval = 0;
-
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
 
-  _xosd_lock(osd);
-  retval = parse_colour(osd, &osd->colour, &osd->pixel, colour);
-  osd->update |= UPD_lines;
-  _xosd_unlock(osd);
-
-  return retval;
+  return _xosd_set_colour(osd, CMD_colour, colour);
 }
 
 /* }}} */
@@ -1049,18 +3906,11 @@ xosd_set_colour(xosd * osd, const char *colour)
 int
 xosd_set_shadow_colour(xosd * osd, const char *colour)
 {
-  int retval = 0;
-
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
 
-  _xosd_lock(osd);
-  retval = parse_colour(osd, &osd->shadow_colour, &osd->shadow_pixel, colour);
-  osd->update |= UPD_lines;
-  _xosd_unlock(osd);
-
-  return retval;
+  return _xosd_set_colour(osd, CMD_shadow_colour, colour);
 }
 
 /* }}} */
@@ -1069,19 +3919,11 @@ xosd_set_shadow_colour(xosd * osd, const char *colour)
 int
 xosd_set_outline_colour(xosd * osd, const char *colour)
 {
-  int retval = 0;
-
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
 
-  _xosd_lock(osd);
-  retval =
-    parse_colour(osd, &osd->outline_colour, &osd->outline_pixel, colour);
-  osd->update |= UPD_lines;
-  _xosd_unlock(osd);
-
-  return retval;
+  return _xosd_set_colour(osd, CMD_outline_colour, colour);
 }
 
 /* }}} */
@@ -1091,36 +3933,13 @@ xosd_set_outline_colour(xosd * osd, const char *colour)
 int
 xosd_set_font(xosd * osd, const char *font)
 {
-  XFontSet fontset2;
-  char **missing;
-  int nmissing;
-  char *defstr;
-  int ret = 0;
-
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
   if (font == NULL)
     return -1;
 
-  /*
-   * Try to create the new font. If it doesn't succeed, keep old font. 
-   */
-  _xosd_lock(osd);
-  fontset2 = XCreateFontSet(osd->display, font, &missing, &nmissing, &defstr);
-  XFreeStringList(missing);
-  if (fontset2 == NULL) {
-    xosd_error = "Requested font not found";
-    ret = -1;
-  } else {
-    if (osd->fontset != NULL)
-      XFreeFontSet(osd->display, osd->fontset);
-    osd->fontset = fontset2;
-    osd->update |= UPD_font;
-  }
-  _xosd_unlock(osd);
-
-  return ret;
+  return _xosd_call(osd, CMD_font, 0, font, POST_sync);
 }
 
 /* }}} */
@@ -1135,12 +3954,7 @@ xosd_set_shadow_offset(xosd * osd, int shadow_offset)
   if (shadow_offset < 0)
     return -1;
 
-  _xosd_lock(osd);
-  osd->shadow_offset = shadow_offset;
-  osd->update |= UPD_font;
-  _xosd_unlock(osd);
-
-  return 0;
+  return _xosd_call(osd, CMD_shadow_offset, shadow_offset, NULL, POST_async);
 }
 
 /* }}} */
@@ -1155,12 +3969,8 @@ xosd_set_outline_offset(xosd * osd, int outline_offset)
   if (outline_offset < 0)
     return -1;
 
-  _xosd_lock(osd);
-  osd->outline_offset = outline_offset;
-  osd->update |= UPD_font;
-  _xosd_unlock(osd);
-
-  return 0;
+  return _xosd_call(osd, CMD_outline_offset, outline_offset, NULL,
+                    POST_async);
 }
 
 /* }}} */
@@ -1173,12 +3983,7 @@ xosd_set_vertical_offset(xosd * osd, int voffset)
   if (osd == NULL)
     return -1;
 
-  _xosd_lock(osd);
-  osd->voffset = voffset;
-  osd->update |= UPD_pos;
-  _xosd_unlock(osd);
-
-  return 0;
+  return _xosd_call(osd, CMD_vertical_offset, voffset, NULL, POST_async);
 }
 
 /* }}} */
@@ -1191,12 +3996,7 @@ xosd_set_horizontal_offset(xosd * osd, int hoffset)
   if (osd == NULL)
     return -1;
 
-  _xosd_lock(osd);
-  osd->hoffset = hoffset;
-  osd->update |= UPD_pos;
-  _xosd_unlock(osd);
-
-  return 0;
+  return _xosd_call(osd, CMD_horizontal_offset, hoffset, NULL, POST_async);
 }
 
 /* }}} */
@@ -1209,12 +4009,7 @@ xosd_set_pos(xosd * osd, xosd_pos pos)
   if (osd == NULL)
     return -1;
 
-  _xosd_lock(osd);
-  osd->pos = pos;
-  osd->update |= UPD_pos;
-  _xosd_unlock(osd);
-
-  return 0;
+  return _xosd_call(osd, CMD_pos, pos, NULL, POST_async);
 }
 
 /* }}} */
@@ -1227,12 +4022,7 @@ xosd_set_align(xosd * osd, xosd_align align)
   if (osd == NULL)
     return -1;
 
-  _xosd_lock(osd);
-  osd->align = align;
-  osd->update |= UPD_content;   /* XOSD_right depends on text width */
-  _xosd_unlock(osd);
-
-  return 0;
+  return _xosd_call(osd, CMD_align, align, NULL, POST_async);
 }
 
 /* }}} */
@@ -1245,12 +4035,14 @@ xosd_get_colour(xosd * osd, int *red, int *green, int *blue)
   if (osd == NULL)
     return -1;
 
+  pthread_mutex_lock(&osd->context->mutex_sync);
   if (red)
-    *red = osd->colour.red;
+    *red = osd->set_colour.red;
   if (blue)
-    *blue = osd->colour.blue;
+    *blue = osd->set_colour.blue;
   if (green)
-    *green = osd->colour.green;
+    *green = osd->set_colour.green;
+  pthread_mutex_unlock(&osd->context->mutex_sync);
 
   return 0;
 }
@@ -1260,15 +4052,24 @@ xosd_get_colour(xosd * osd, int *red, int *green, int *blue)
 /* xosd_set_timeout -- Change the time before display is hidden. {{{ */
 int
 xosd_set_timeout(xosd * osd, int timeout)
+{
+  FUNCTION_START(Dfunction);
+  if (timeout > INT_MAX / 1000)
+    timeout = INT_MAX / 1000;
+  return xosd_set_timeout_ms(osd, timeout > 0 ? timeout * 1000 : timeout);
+}
+
+/* }}} */
+
+/* xosd_set_timeout_ms -- Change the time before display is hidden. {{{ */
+int
+xosd_set_timeout_ms(xosd * osd, int timeout)
 {
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
-  _xosd_lock(osd);
-  osd->timeout = timeout;
-  osd->update |= UPD_timer;
-  _xosd_unlock(osd);
-  return 0;
+
+  return _xosd_call(osd, CMD_timeout, timeout, NULL, POST_async);
 }
 
 /* }}} */
@@ -1281,14 +4082,8 @@ xosd_hide(xosd * osd)
   if (osd == NULL)
     return -1;
 
-  if (osd->generation & 1) {
-    _xosd_lock(osd);
-    osd->update &= ~UPD_show;
-    osd->update |= UPD_hide;
-    _xosd_unlock(osd);
-    return 0;
-  }
-  return -1;
+  /* Posted without waiting: the plugins hide from GTK callbacks. */
+  return _xosd_call(osd, CMD_hide, 0, NULL, POST_async);
 }
 
 /* }}} */
@@ -1301,14 +4096,14 @@ xosd_show(xosd * osd)
   if (osd == NULL)
     return -1;
 
-  if (~osd->generation & 1) {
-    _xosd_lock(osd);
-    osd->update &= ~UPD_hide;
-    osd->update |= UPD_show | UPD_timer;
-    _xosd_unlock(osd);
-    return 0;
-  }
-  return -1;
+  if (_xosd_in_batch(osd))
+    return _xosd_call(osd, CMD_show, 0, NULL, POST_show);
+  if (osd->async)
+    return _xosd_call(osd, CMD_show, 0, NULL, POST_async);
+  if (_xosd_call(osd, CMD_show, 0, NULL, POST_sync) == -1
+      || _xosd_show_failed(osd))
+    return -1;
+  return 0;
 }
 
 /* }}} */
@@ -1317,32 +4112,72 @@ xosd_show(xosd * osd)
 int
 xosd_scroll(xosd * osd, int lines)
 {
-  int i;
-  union xosd_line *src, *dst;
-
   FUNCTION_START(Dfunction);
   if (osd == NULL)
     return -1;
   if (lines <= 0 || lines > osd->number_lines)
     return -1;
 
-  _xosd_lock(osd);
-  /* Clear old text */
-  for (i = 0, src = osd->lines; i < lines; i++, src++)
-    if (src->type == LINE_text && src->text.string) {
-      free(src->text.string);
-      src->text.string = NULL;
-    }
-  /* Move following lines forward */
-  for (dst = osd->lines; i < osd->number_lines; i++)
-    *dst++ = *src++;
-  /* Blank new lines */
-  for (; dst < src; dst++) {
-    dst->type = LINE_blank;
-    dst->text.string = NULL;
-  }
-  osd->update |= UPD_content;
-  _xosd_unlock(osd);
+  return _xosd_call(osd, CMD_scroll, lines, NULL, POST_async);
+}
+
+/* }}} */
+
+/* xosd_set_cache_size -- Change the memory budget of the line cache {{{ */
+int
+xosd_set_cache_size(xosd * osd, int bytes)
+{
+  FUNCTION_START(Dfunction);
+  if (osd == NULL || bytes < 0)
+    return -1;
+
+  return _xosd_call(osd, CMD_cache_size, bytes, NULL, POST_async);
+}
+
+/* }}} */
+
+/* xosd_get_stats -- Get the counters of the display {{{ */
+int
+xosd_get_stats(xosd * osd, struct xosd_stats *stats)
+{
+  FUNCTION_START(Dfunction);
+  if (osd == NULL || stats == NULL)
+    return -1;
+
+  *stats = osd->stats;
+  pthread_mutex_lock(&osd->context->mutex_sync);
+  stats->stages[XOSD_stage_wait] = osd->wait;
+  pthread_mutex_unlock(&osd->context->mutex_sync);
+  stats->wakeups = osd->context->wakeups;
+  stats->select_timeouts = osd->context->select_timeouts;
+  return 0;
+}
+
+/* }}} */
+
+/* xosd_text_extents -- Measure text as it would be displayed {{{ */
+int
+xosd_text_extents(xosd * osd, const char *string, int *width, int *height)
+{
+  int result[3];
+  struct xosd_cmd *cmd;
+
+  FUNCTION_START(Dfunction);
+  if (osd == NULL || string == NULL)
+    return -1;
+
+  cmd = _xosd_cmd_new(osd, CMD_extents, 0, string);
+  if (cmd == NULL)
+    return -1;
+  result[0] = -1;
+  cmd->result = result;
+  _xosd_post(osd, cmd, POST_sync);
+  if (result[0] == -1)
+    return -1;
+  if (width)
+    *width = result[1];
+  if (height)
+    *height = result[2];
   return 0;
 }
 
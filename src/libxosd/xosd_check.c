@@ -0,0 +1,513 @@
+/* xosd_check -- checks of libxosd not needing an X server
+ *
+ * Run by "make check". Includes xosd.c to reach its internals and drives
+ * the parts which do not talk to the server on an object set up by hand:
+ * the command queue and its pool, batches, the line ring and its dirty
+ * bitmap, the suppression of unchanged lines, the hide/show decision and
+ * the LRU of the line cache. The checks using a server are in
+ * ../xosd_test.c.
+ */
+#include <X11/Xlib.h>
+
+/* No X server: cached pixmaps are just numbered, copying does nothing. */
+static Pixmap pixmaps;
+static int
+_check_copy_area(Display * display, Drawable src, Drawable dst, GC gc,
+                 int x, int y, unsigned int width, unsigned int height,
+                 int dx, int dy)
+{
+  return 0;
+}
+#define XCreatePixmap(display, d, width, height, depth) (++pixmaps)
+#define XFreePixmap(display, pixmap) ((void) 0)
+#define XCopyArea _check_copy_area
+
+#include "xosd.c"
+
+#ifdef __GLIBC__
+/* Count calls of the allocator by wrapping the glibc entry points. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *
+malloc(size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_realloc(ptr, size);
+}
+#define ALLOCS() __sync_add_and_fetch(&allocs, 0)
+#else
+#define ALLOCS() 0UL
+#endif
+
+#define FAIL(...) \
+  do { \
+    fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, "\n"); \
+    return -1; \
+  } while (0)
+
+/* The context of all objects; threaded, so nobody applies commands but
+ * the checks themselves. */
+static xosd_context context;
+
+/* Set up what the API and the event thread use apart from X11. */
+static xosd *
+new_osd(int number_lines)
+{
+  xosd *osd = calloc(1, sizeof(xosd));
+
+  if (osd == NULL)
+    return NULL;
+  osd->context = &context;
+  osd->number_lines = number_lines;
+  osd->lines = calloc(number_lines, sizeof(union xosd_line));
+  osd->dirty = calloc(DIRTY_WORDS(number_lines), sizeof(unsigned long));
+  osd->line_bufs = calloc(number_lines, sizeof(struct xosd_buf));
+  osd->cache_size = XOSD_CACHE_SIZE;
+  osd->timeout = -1;
+  pthread_mutex_init(&osd->mutex_pool, NULL);
+  pthread_mutex_init(&osd->mutex_batch, NULL);
+  return osd;
+}
+
+static void
+free_osd(xosd * osd)
+{
+  int i;
+
+  _xosd_cmd_free(_xosd_take(osd));
+  _xosd_cmd_free(osd->cmd_pool);
+  for (i = 0; i < osd->number_lines; i++)
+    free(osd->line_bufs[i].data);
+  free(osd->line_bufs);
+  free(osd->lines);
+  free(osd->dirty);
+  free(osd->cache_pool);
+  pthread_mutex_destroy(&osd->mutex_pool);
+  pthread_mutex_destroy(&osd->mutex_batch);
+  free(osd);
+}
+
+/* Checks, each returns 0 if it passed. {{{ */
+
+/* Commands of concurrent producers arrive completely and each producer's
+ * in its posting order. Once the pool holds enough of them, posting does
+ * not allocate. */
+#define PRODUCERS 4
+#define POSTS 20000
+static void *
+produce(void *arg)
+{
+  xosd *osd = arg;
+  static int next;
+  int i, t = __sync_fetch_and_add(&next, 1);
+
+  for (i = 0; i < POSTS; i++)
+    _xosd_call(osd, CMD_timeout, t * POSTS + i, NULL, POST_async);
+  return NULL;
+}
+
+static int
+consume(xosd * osd, int *expect, int total)
+{
+  struct xosd_cmd *list, *cmd, *last;
+  int count = 0;
+
+  while (count < total) {
+    list = _xosd_take(osd);
+    if (list == NULL) {
+      sched_yield();
+      continue;
+    }
+    for (cmd = list; cmd; cmd = cmd->next) {
+      int t = cmd->value / POSTS % PRODUCERS;
+      if (cmd->type != CMD_timeout || cmd->value % POSTS != expect[t])
+        FAIL("command %d of producer %d out of order", cmd->value, t);
+      expect[t]++;
+      count++;
+      last = cmd;
+    }
+    _xosd_cmd_put(osd, list, last);
+  }
+  return 0;
+}
+
+static int
+check_queue_order(void)
+{
+  xosd *osd = new_osd(1);
+  pthread_t threads[PRODUCERS];
+  int expect[PRODUCERS] = { 0 }, i, ret;
+
+  if (osd == NULL)
+    return -1;
+  for (i = 0; i < PRODUCERS; i++)
+    pthread_create(&threads[i], NULL, produce, osd);
+  ret = consume(osd, expect, PRODUCERS * POSTS);
+  for (i = 0; i < PRODUCERS; i++)
+    pthread_join(threads[i], NULL);
+  if (ret == 0 && _xosd_take(osd) != NULL)
+    ret = -1;
+  if (osd->seq_posted != PRODUCERS * POSTS)
+    ret = -1;
+  free_osd(osd);
+  return ret;
+}
+
+static int
+check_queue_no_allocs(void)
+{
+  xosd *osd = new_osd(1);
+  unsigned long allocated;
+  struct xosd_cmd *list, *last;
+  int round, i, ret = 0;
+
+  if (osd == NULL)
+    return -1;
+  for (round = 0; round < 2 && ret == 0; round++) {
+    allocated = ALLOCS();
+    for (i = 0; i < 100; i++)
+      _xosd_call(osd, CMD_timeout, i, NULL, POST_async);
+    list = _xosd_take(osd);
+    for (last = list; last->next; last = last->next);
+    _xosd_cmd_put(osd, list, last);
+    allocated = ALLOCS() - allocated;
+    if (round == 1 && allocated) {
+      fprintf(stderr, "%lu allocations for pooled commands\n", allocated);
+      ret = -1;
+    }
+  }
+  free_osd(osd);
+  return ret;
+}
+
+/* A batch is pushed as one chain in posting order on commit. */
+static int
+check_batch(void)
+{
+  xosd *osd = new_osd(1);
+  struct xosd_cmd *list, *cmd;
+  int i, ret = 0;
+
+  if (osd == NULL)
+    return -1;
+  if (xosd_begin_update(osd) == -1)
+    ret = -1;
+  for (i = 0; i < 3; i++)
+    _xosd_call(osd, CMD_timeout, i, NULL, POST_async);
+  if (_xosd_take(osd) != NULL)
+    ret = -1;                   /* nothing before the commit */
+  if (xosd_commit(osd) == -1)
+    ret = -1;
+  list = _xosd_take(osd);
+  for (i = 0, cmd = list; cmd; cmd = cmd->next, i++)
+    if (cmd->value != i || cmd->seq != (unsigned long) i + 1)
+      ret = -1;
+  if (i != 3)
+    ret = -1;
+  _xosd_cmd_free(list);
+  free_osd(osd);
+  return ret;
+}
+
+/* dirty_scroll() moves the bits of all words like a bit-by-bit shift. */
+static int
+check_dirty_scroll(void)
+{
+  static const int sizes[] = { 1, 5, 63, 64, 65, 130, 200 };
+  unsigned char before[200];
+  unsigned int seed = 1;
+  int s, lines, i;
+
+  for (s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+    xosd *osd = new_osd(sizes[s]);
+    int n = sizes[s];
+    if (osd == NULL)
+      return -1;
+    for (lines = 1; lines <= n; lines++) {
+      DIRTY_CLEAR(osd);
+      for (i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        before[i] = (seed >> 16) & 1;
+        if (before[i])
+          DIRTY_SET(osd, i);
+      }
+      dirty_scroll(osd, lines);
+      for (i = 0; i < n; i++) {
+        int expect = (i + lines < n) ? before[i + lines] : 1;
+        if (!DIRTY_ISSET(osd, i) != !expect) {
+          free_osd(osd);
+          FAIL("%d lines scrolled by %d: line %d", n, lines, i);
+        }
+      }
+    }
+    free_osd(osd);
+  }
+  return 0;
+}
+
+/* Apply everything posted so far, like the event thread does. */
+static void
+apply(xosd * osd)
+{
+  apply_commands(osd);
+  osd->update = UPD_none;
+}
+
+static const char *
+text_of(xosd * osd, int line)
+{
+  union xosd_line *l = LINE(osd, line);
+  return (l->type == LINE_text) ? l->text.string : NULL;
+}
+
+/* Scrolling rotates the ring, keeps the content of the lines moving up and
+ * blanks the new ones, which are dirty together with the moved dirty
+ * lines. */
+static int
+check_scroll_ring(void)
+{
+  static const char *text[] = { "zero", "one", "two", "three", "four" };
+  xosd *osd = new_osd(5);
+  int i, ret = 0;
+
+  if (osd == NULL)
+    return -1;
+  for (i = 0; i < 5; i++)
+    xosd_display_async(osd, i, XOSD_string, text[i]);
+  apply(osd);
+  DIRTY_CLEAR(osd);
+  DIRTY_SET(osd, 3);
+  xosd_scroll(osd, 2);
+  apply(osd);
+  for (i = 0; i < 3; i++)
+    if (text_of(osd, i) == NULL || strcmp(text_of(osd, i), text[i + 2]))
+      ret = -1;
+  if (text_of(osd, 3) || text_of(osd, 4))
+    ret = -1;
+  if (DIRTY_ISSET(osd, 0) || !DIRTY_ISSET(osd, 1) || DIRTY_ISSET(osd, 2)
+      || !DIRTY_ISSET(osd, 3) || !DIRTY_ISSET(osd, 4))
+    ret = -1;
+  /* A new line goes into the slot of the blank line, not over another. */
+  xosd_display_async(osd, 4, XOSD_string, "five");
+  apply(osd);
+  if (text_of(osd, 4) == NULL || strcmp(text_of(osd, 4), "five")
+      || strcmp(text_of(osd, 0), "two"))
+    ret = -1;
+  free_osd(osd);
+  return ret;
+}
+
+/* Only lines showing the same again are suppressed, also if a borrowed
+ * buffer is reused with new content. */
+static int
+check_same_line(void)
+{
+  static char buffer[16];
+  xosd *osd = new_osd(2);
+  unsigned long suppressed;
+  int ret = 0;
+
+  if (osd == NULL)
+    return -1;
+  strcpy(buffer, "Borrowed 1");
+  xosd_display_async(osd, 0, XOSD_borrowed, buffer);
+  xosd_display_async(osd, 1, XOSD_percentage, 40);
+  apply(osd);
+  suppressed = osd->stats.redraws_suppressed;
+  strcpy(buffer, "Borrowed 2");
+  xosd_display_async(osd, 0, XOSD_borrowed, buffer);
+  xosd_display_async(osd, 1, XOSD_percentage, 41);
+  apply(osd);
+  if (osd->stats.redraws_suppressed != suppressed)
+    ret = -1;
+  xosd_display_async(osd, 0, XOSD_borrowed, buffer);
+  xosd_display_async(osd, 0, XOSD_string, "Borrowed 2");
+  xosd_display_async(osd, 1, XOSD_percentage, 41);
+  apply(osd);
+  if (osd->stats.redraws_suppressed != suppressed + 3)
+    ret = -1;
+  free_osd(osd);
+  return ret;
+}
+
+/* Apply one hide or show and return its result. */
+static int
+hide_show(xosd * osd, enum CMD type)
+{
+  struct xosd_cmd cmd;
+  int ret = 0;
+
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.type = type;
+  cmd.result = &ret;
+  apply_command(osd, &cmd);
+  return ret;
+}
+
+/* Hide and show are decided from the state left by the commands applied
+ * before them, not by what is mapped right now. */
+static int
+check_hide_show(void)
+{
+  xosd *osd = new_osd(1);
+  int ret = 0;
+
+  if (osd == NULL)
+    return -1;
+  /* Hidden. */
+  if (hide_show(osd, CMD_hide) != -1 || hide_show(osd, CMD_show) != 0
+      || hide_show(osd, CMD_show) != -1 || hide_show(osd, CMD_hide) != 0
+      || hide_show(osd, CMD_hide) != -1)
+    ret = -1;
+  if (osd->update & UPD_show)
+    ret = -1;
+  /* Mapped. */
+  osd->update = UPD_none;
+  osd->generation = 1;
+  if (hide_show(osd, CMD_show) != -1 || hide_show(osd, CMD_hide) != 0
+      || !(osd->update & UPD_hide) || hide_show(osd, CMD_show) != 0
+      || (osd->update & UPD_hide))
+    ret = -1;
+  free_osd(osd);
+  return ret;
+}
+
+/* Cache text s<i> like draw_text() does. */
+static void
+cache_text(xosd * osd, int i)
+{
+  char s[16];
+
+  snprintf(s, sizeof(s), "s%d", i);
+  cache_add(osd, s, _xosd_hash(s), 0, 0, 0, 10);
+}
+
+static int
+cached(xosd * osd, int i)
+{
+  char s[16];
+
+  snprintf(s, sizeof(s), "s%d", i);
+  return cache_lookup(osd, s, _xosd_hash(s)) != NULL;
+}
+
+/* With all slots in use the least recently used entry is replaced, the
+ * byte budget drops the oldest ones, and neither allocates. */
+static int
+check_cache_lru(void)
+{
+  xosd *osd = new_osd(1);
+  struct xosd_cache *pool;
+  unsigned long allocated, bytes;
+  int i, ret = 0;
+
+  if (osd == NULL)
+    return -1;
+  osd->width = 1000;
+  osd->line_height = 10;
+  osd->depth = 24;
+
+  for (i = 0; i < XOSD_CACHE_ENTRIES; i++)
+    cache_text(osd, i);
+  pool = osd->cache_pool;
+  bytes = osd->stats.cache_bytes / XOSD_CACHE_ENTRIES;
+  if (osd->stats.cache_entries != XOSD_CACHE_ENTRIES
+      || osd->stats.cache_evictions)
+    ret = -1;
+  if (!cached(osd, 0))          /* now the most recently used */
+    ret = -1;
+
+  allocated = ALLOCS();
+  cache_text(osd, XOSD_CACHE_ENTRIES);
+  allocated = ALLOCS() - allocated;
+  if (allocated || osd->cache_pool != pool)
+    ret = -1;
+  if (osd->stats.cache_entries != XOSD_CACHE_ENTRIES
+      || osd->stats.cache_evictions != 1)
+    ret = -1;
+  if (cached(osd, 1) || !cached(osd, 0) || !cached(osd, 2)
+      || !cached(osd, XOSD_CACHE_ENTRIES))
+    ret = -1;
+
+  /* Most recent now: s64, s2, s0, s63, s62, ... */
+  cache_trim(osd, 4 * bytes);
+  if (osd->stats.cache_entries != 4 || osd->stats.cache_bytes > 4 * bytes)
+    ret = -1;
+  if (!cached(osd, XOSD_CACHE_ENTRIES) || !cached(osd, 2)
+      || !cached(osd, 0) || !cached(osd, XOSD_CACHE_ENTRIES - 1)
+      || cached(osd, XOSD_CACHE_ENTRIES - 2))
+    ret = -1;
+
+  /* A freed slot is used again before anything is evicted. */
+  i = osd->stats.cache_evictions;
+  cache_text(osd, 100);
+  if (osd->stats.cache_evictions != (unsigned long) i
+      || osd->stats.cache_entries != 5)
+    ret = -1;
+
+  cache_trim(osd, 0);
+  if (osd->cache || osd->stats.cache_entries || osd->stats.cache_bytes)
+    ret = -1;
+  free_osd(osd);
+  return ret;
+}
+
+static const struct check
+{
+  const char *name;
+  int (*check) (void);
+} checks[] = {
+  {"queue_order", check_queue_order},
+  {"queue_no_allocs", check_queue_no_allocs},
+  {"batch", check_batch},
+  {"dirty_scroll", check_dirty_scroll},
+  {"scroll_ring", check_scroll_ring},
+  {"same_line", check_same_line},
+  {"hide_show", check_hide_show},
+  {"cache_lru", check_cache_lru},
+  {NULL, NULL}
+};
+
+/* }}} */
+
+int
+main(int argc, char *argv[])
+{
+  const struct check *c;
+  int failed = 0;
+
+  if (_xosd_notify_open(context.wakefd) == -1) {
+    perror("xosd_check");
+    return EXIT_FAILURE;
+  }
+  context.threaded = 1;
+
+  for (c = checks; c->name; c++) {
+    int ret = c->check();
+    printf("%-24s %s\n", c->name, (ret == 0) ? "ok" : "FAILED");
+    if (ret != 0)
+      failed++;
+  }
+  _xosd_notify_close(context.wakefd);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
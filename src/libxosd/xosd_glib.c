@@ -0,0 +1,151 @@
+/*
+ * XOSD - X On-Screen Display library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+/* GLib main loop adapter, see xosd_glib.h. Built as libxosd_glib against
+ * GLib 2; the xmms plugin compiles it against GLib 1.2 itself. */
+#include <glib.h>
+#include <xosd.h>
+#include "xosd_glib.h"
+
+struct xosd_source
+{
+#if GLIB_MAJOR_VERSION >= 2
+  GSource source;               /* first, g_source_new() allocates it all */
+#endif
+  xosd *osd;
+  int nfds;
+  GPollFD fds[XOSD_MAX_FDS];
+};
+
+static gboolean
+_xosd_source_prepare(struct xosd_source *s, gint * timeout)
+{
+  *timeout = xosd_next_timeout(s->osd);
+  return *timeout == 0;
+}
+
+static gboolean
+_xosd_source_check(struct xosd_source *s)
+{
+  int i;
+
+  for (i = 0; i < s->nfds; i++)
+    if (s->fds[i].revents & G_IO_IN)
+      return TRUE;
+  return xosd_next_timeout(s->osd) == 0;
+}
+
+#if GLIB_MAJOR_VERSION >= 2
+static gboolean
+_xosd_source_prepare2(GSource * source, gint * timeout)
+{
+  return _xosd_source_prepare((struct xosd_source *) source, timeout);
+}
+
+static gboolean
+_xosd_source_check2(GSource * source)
+{
+  return _xosd_source_check((struct xosd_source *) source);
+}
+
+static gboolean
+_xosd_source_dispatch2(GSource * source, GSourceFunc callback, gpointer data)
+{
+  xosd_dispatch(((struct xosd_source *) source)->osd);
+  return TRUE;
+}
+
+static GSourceFuncs _xosd_source_funcs = {
+  _xosd_source_prepare2,
+  _xosd_source_check2,
+  _xosd_source_dispatch2,
+  NULL
+};
+#else
+static gboolean
+_xosd_source_prepare1(gpointer data, GTimeVal * now, gint * timeout,
+                      gpointer user_data)
+{
+  return _xosd_source_prepare(data, timeout);
+}
+
+static gboolean
+_xosd_source_check1(gpointer data, GTimeVal * now, gpointer user_data)
+{
+  return _xosd_source_check(data);
+}
+
+static gboolean
+_xosd_source_dispatch1(gpointer data, GTimeVal * now, gpointer user_data)
+{
+  xosd_dispatch(((struct xosd_source *) data)->osd);
+  return TRUE;
+}
+
+/* The polls are global in GLib 1.2, so they must be removed explicitly. */
+static void
+_xosd_source_destroy1(gpointer data)
+{
+  struct xosd_source *s = data;
+  int i;
+
+  for (i = 0; i < s->nfds; i++)
+    g_main_remove_poll(&s->fds[i]);
+  g_free(s);
+}
+
+static GSourceFuncs _xosd_source_funcs = {
+  _xosd_source_prepare1,
+  _xosd_source_check1,
+  _xosd_source_dispatch1,
+  _xosd_source_destroy1
+};
+#endif
+
+/* xosd_source_add -- Let the GLib main loop drive a display {{{ */
+guint
+xosd_source_add(xosd * osd)
+{
+  struct xosd_source *s;
+  int fds[XOSD_MAX_FDS], i, n;
+  guint id;
+
+  n = xosd_get_fds(osd, fds, XOSD_MAX_FDS);
+  if (n == -1)
+    return 0;
+
+#if GLIB_MAJOR_VERSION >= 2
+  s = (struct xosd_source *) g_source_new(&_xosd_source_funcs,
+                                          sizeof(struct xosd_source));
+#else
+  s = g_new0(struct xosd_source, 1);
+#endif
+  s->osd = osd;
+  s->nfds = n;
+  for (i = 0; i < n; i++) {
+    s->fds[i].fd = fds[i];
+    s->fds[i].events = G_IO_IN;
+    s->fds[i].revents = 0;
+#if GLIB_MAJOR_VERSION >= 2
+    g_source_add_poll(&s->source, &s->fds[i]);
+#else
+    g_main_add_poll(&s->fds[i], G_PRIORITY_DEFAULT);
+#endif
+  }
+
+#if GLIB_MAJOR_VERSION >= 2
+  id = g_source_attach(&s->source, NULL);
+  g_source_unref(&s->source);   /* The main context holds it now. */
+#else
+  id = g_source_add(G_PRIORITY_DEFAULT, FALSE, &_xosd_source_funcs, s,
+                    NULL, NULL);
+#endif
+  return id;
+}
+
+/* }}} */
@@ -53,7 +53,7 @@ int percentage = 50;
 int outline_offset = 0;
 char *outline_colour = NULL;
 char *shadow_colour = NULL;
-int delay = 5;
+int delay = 5000;                /* milliseconds */
 int forcewait = 0;
 xosd_pos pos = XOSD_top;
 int voffset = 0;
@@ -81,7 +81,7 @@ main(int argc, char *argv[])
       break;
     switch (c) {
     case 'a':
-      scroll_age = optarg ? atoi(optarg) : delay;
+      scroll_age = optarg ? atoi(optarg) : (delay + 999) / 1000;
       break;
     case 'w':
       forcewait = 1;
@@ -119,7 +119,7 @@ main(int argc, char *argv[])
       colour = optarg;
       break;
     case 'd':
-      delay = atoi(optarg);
+      delay = strtod(optarg, NULL) * 1000;
       break;
     case 'o':
       voffset = atoi(optarg);
@@ -229,12 +229,13 @@ main(int argc, char *argv[])
     fprintf(stderr, "Error initializing osd: %s\n", xosd_error);
     return EXIT_FAILURE;
   }
+  xosd_begin_update(osd);
   xosd_set_shadow_offset(osd, shadow);
   if (shadow_colour) xosd_set_shadow_colour(osd, shadow_colour);
   xosd_set_outline_offset(osd, outline_offset);
   if (outline_colour) xosd_set_outline_colour(osd, outline_colour);
   if (colour) xosd_set_colour(osd, colour);
-  xosd_set_timeout(osd, delay);
+  xosd_set_timeout_ms(osd, delay);
   xosd_set_pos(osd, pos);
   xosd_set_vertical_offset(osd, voffset);
   xosd_set_horizontal_offset(osd, hoffset);
@@ -249,12 +250,15 @@ main(int argc, char *argv[])
     case bar_percentage:
       if (text) xosd_display(osd, 0, XOSD_string, text);
       xosd_display(osd, text ? 1 : 0, XOSD_percentage, percentage);
+      xosd_commit(osd);
       break;
     case bar_slider:
       if (text) xosd_display(osd, 0, XOSD_string, text);
       xosd_display(osd, text ? 1 : 0, XOSD_slider, percentage);
+      xosd_commit(osd);
       break;
     case bar_none:
+      xosd_commit(osd);
       /* Not really needed, but at least we aren't throwing around an unknown value */
       old_age.tv_sec = 0;
 
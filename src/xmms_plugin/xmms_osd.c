@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <ctype.h>
 #include <gtk/gtk.h>
+#include <xosd_glib.h>
 
 #include "xmms_osd.h"
 
@@ -60,6 +61,7 @@ struct show show;
 
 xosd *osd = NULL;
 static guint timeout_tag;
+static guint source_tag;
 
 gchar *font;
 gchar *colour;
@@ -92,6 +94,9 @@ init(void)
 
   if (osd) {
     DEBUG("uniniting osd");
+    if (source_tag)
+      g_source_remove(source_tag);
+    source_tag = 0;
     xosd_destroy(osd);
     osd = NULL;
   }
@@ -114,7 +119,10 @@ init(void)
 
   DEBUG("calling osd init function");
 
-  osd = xosd_create(2);
+  /* Driven by the main loop, all calls are made from the GTK thread. */
+  osd = xosd_create_unthreaded(2);
+  if (osd)
+    source_tag = xosd_source_add(osd);
   apply_config();
   DEBUG("osd initialized");
   if (osd)
@@ -151,6 +159,9 @@ cleanup(void)
     DEBUG("hide");
     xosd_hide(osd);
     DEBUG("uninit");
+    if (source_tag)
+      g_source_remove(source_tag);
+    source_tag = 0;
     xosd_destroy(osd);
     DEBUG("done with osd");
     osd = NULL;
@@ -258,6 +269,7 @@ apply_config(void)
 {
   DEBUG("apply_config");
   if (osd) {
+    xosd_begin_update(osd);
     if (xosd_set_font(osd, font) == -1)
       DEBUG("invalid font %s", font);
 
@@ -269,6 +281,7 @@ apply_config(void)
     xosd_set_align(osd, align);
     xosd_set_vertical_offset(osd, offset);
     xosd_set_horizontal_offset(osd, h_offset);
+    xosd_commit(osd);
   }
   DEBUG("done");
 }
@@ -379,11 +392,11 @@ timeout_func(gpointer data)
   }
 
   /* Decide what to display, in decreasing priority. */
+  /* Both lines are updated in one batch to not show a half-updated OSD. */
   if (showtext) {
-    xosd_display(osd, 0, XOSD_string, text);
+    char *title = NULL;
     if (show.trackname && (current.title != NULL)) {
       int len;
-      char *title;
       gint playlist_time;
 
       len = 13 + strlen(current.title) + (withtime ? 11 : 0);
@@ -395,28 +408,38 @@ timeout_func(gpointer data)
                current.pos + 1, playlist_length, current.title,
                playlist_time / 1000 / 60, playlist_time / 1000 % 60);
       replace_hexcodes(title);
-      xosd_display(osd, 1, XOSD_string, title);
-      free(title);
-    } else
-      xosd_display(osd, 1, XOSD_string, "");
+    }
+    xosd_begin_update(osd);
+    xosd_display(osd, 0, XOSD_string, text);
+    xosd_display(osd, 1, XOSD_string, title ? title : "");
+    xosd_commit(osd);
+    free(title);
   } else if (current.volume != previous.volume && show.volume) {
     DEBUG("V: %d->%d\n", previous.volume, current.volume);
     /* xmms returns -1 during a title change. skip this and try again later. */
     if ((previous.volume == -1) || (current.volume == -1))
       goto skip;
+    xosd_begin_update(osd);
     xosd_display(osd, 0, XOSD_string, "Volume");
     xosd_display(osd, 1, XOSD_percentage, current.volume);
+    xosd_commit(osd);
   } else if (current.balance != previous.balance && show.balance) {
     DEBUG("B: %d->%d\n", previous.balance, current.balance);
     /* FIXME: Same as above might happen, but with what values? */
+    xosd_begin_update(osd);
     xosd_display(osd, 0, XOSD_string, "Balance");
     xosd_display(osd, 1, XOSD_slider, current.balance);
+    xosd_commit(osd);
   } else if (current.repeat != previous.repeat && show.repeat) {
+    xosd_begin_update(osd);
     xosd_display(osd, 0, XOSD_string, "Repeat");
     xosd_display(osd, 1, XOSD_string, current.repeat ? "On" : "Off");
+    xosd_commit(osd);
   } else if (current.shuffle != previous.shuffle && show.shuffle) {
+    xosd_begin_update(osd);
     xosd_display(osd, 0, XOSD_string, "Shuffle");
     xosd_display(osd, 1, XOSD_string, current.shuffle ? "On" : "Off");
+    xosd_commit(osd);
   }
 
 skip:
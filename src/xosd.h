@@ -23,13 +23,17 @@ extern "C"
 /* The XOSD display "object" */
   typedef struct xosd xosd;
 
+/* One X11 connection and event thread shared by several displays */
+  typedef struct xosd_context xosd_context;
+
 /* The type of data that can be displayed. */
   typedef enum
   {
     XOSD_percentage,            /* Percentage bar (like a progress bar) */
     XOSD_string,                /* Text */
     XOSD_printf,                /* Formatted Text */
-    XOSD_slider                 /* Slider (like a volume control) */
+    XOSD_slider,                /* Slider (like a volume control) */
+    XOSD_borrowed               /* Text not copied, see xosd_display() */
   } xosd_command;
 
 /* Position of the display */
@@ -48,7 +52,68 @@ extern "C"
     XOSD_right
   } xosd_align;
 
+/* Events reported by xosd_read_events(). */
+  typedef enum
+  {
+    XOSD_event_show = 1,        /* The display was mapped. */
+    XOSD_event_hide = 2,        /* The display was unmapped. */
+    XOSD_event_frame = 4        /* New content was sent to the X server. */
+  } xosd_event;
+
+/* Timed stages of the event thread and its callers. */
+  enum xosd_stage
+  {
+    XOSD_stage_size,            /* font or window size changed */
+    XOSD_stage_pos,             /* window moved */
+    XOSD_stage_lines,           /* dirty lines drawn into the bitmaps */
+    XOSD_stage_mask,            /* XShape updated */
+    XOSD_stage_copy,            /* bitmaps copied to the window */
+    XOSD_stage_flush,           /* requests sent to the X server */
+    XOSD_stage_wait,            /* callers waiting for their commands */
+    XOSD_STAGES
+  };
+
+/* Durations of one stage. Bucket 0 counts durations below 1 microsecond,
+ * bucket i those below 2^i microseconds and the last one all longer. */
+#define XOSD_HISTOGRAM_BUCKETS 16
+  struct xosd_histogram
+  {
+    unsigned long count;
+    unsigned long total_ns;
+    unsigned long max_ns;
+    unsigned long buckets[XOSD_HISTOGRAM_BUCKETS];
+  };
+
+/* Counters of a xosd "object", see xosd_get_stats(). */
+  struct xosd_stats
+  {
+    unsigned long cache_hits;   /* lines copied from the cache */
+    unsigned long cache_misses; /* lines rendered into the cache */
+    unsigned long cache_evictions;      /* lines dropped from the cache */
+    unsigned long cache_entries;        /* lines in the cache */
+    unsigned long cache_bytes;  /* estimated X server memory of the cache */
+    unsigned long frames;       /* updates which redrew lines */
+    unsigned long image_bytes;  /* uploaded by the client rasterizer */
+    unsigned long pixmap_bytes; /* estimated X server memory of the window */
+    unsigned long extents_hits; /* text measurements found in the cache */
+    unsigned long extents_misses;       /* text measured by the font */
+    unsigned long redraws_suppressed;   /* xosd_display() of unchanged lines */
+    unsigned long expose_events;        /* parts of the window redrawn */
+    unsigned long wakeups;      /* event thread woken by commands, and */
+    unsigned long select_timeouts;      /* by timeouts, both per context */
+    struct xosd_histogram stages[XOSD_STAGES];
+  };
+
 /* xosd_create -- Create a new xosd "object"
+ *
+ * The default font is only loaded when the display is shown for the first
+ * time without a font set by xosd_set_font(). If it cannot be loaded, that
+ * xosd_display() or xosd_show() fails instead of xosd_create().
+ *
+ * Text is drawn with core X11 fonts. If the environment variable XOSD_RENDER
+ * is set to "xft", anti-aliased Xft fonts are used when the X server supports
+ * the RENDER extension. With "image" all drawing is done on the client and
+ * uploaded as one image per update, through MIT-SHM when available.
  *
  * ARGUMENTS
  *     number_lines   Number of lines of the display.
@@ -58,6 +123,102 @@ extern "C"
  */
   xosd *xosd_create(int number_lines);
 
+/* xosd_create_unthreaded -- Create a new xosd "object" without event thread
+ *
+ * For single-threaded applications with a poll() loop of their own, like
+ * GTK programs. The display does no work by itself: the application polls
+ * the descriptors of xosd_get_fds() for reading, at most for
+ * xosd_next_timeout() milliseconds, and then calls xosd_dispatch(). All
+ * functions of the display must be called from that same thread.
+ * xosd_source_add() of libxosd_glib (xosd_glib.h) does all this for the GLib
+ * main loop.
+ *
+ * ARGUMENTS
+ *     number_lines   Number of lines of the display.
+ *
+ * RETURNS
+ *     A new xosd structure, NULL on failure.
+ */
+  xosd *xosd_create_unthreaded(int number_lines);
+
+/* xosd_get_fds -- Get the descriptors to poll for xosd_dispatch
+ *
+ * The descriptors stay the same until xosd_destroy().
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     fds      Array receiving the descriptors.
+ *     size     Number of elements of fds, XOSD_MAX_FDS suffice.
+ *
+ * RETURNS
+ *     The number of descriptors stored in fds
+ *    -1 on failure
+ */
+#define XOSD_MAX_FDS 3
+  int xosd_get_fds(xosd * osd, int *fds, int size);
+
+/* xosd_next_timeout -- Get the time until xosd_dispatch must be called
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *
+ * RETURNS
+ *     Milliseconds until the next deadline not signalled by one of the
+ *     descriptors of xosd_get_fds(), 0 if it has passed already
+ *    -1 if there is none
+ */
+  int xosd_next_timeout(xosd * osd);
+
+/* xosd_dispatch -- Handle pending work of an unthreaded object
+ *
+ * Applies queued changes, redraws, handles X11 events and hides the display
+ * when its timeout expired. Never blocks.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object" created by xosd_create_unthreaded().
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+ */
+  int xosd_dispatch(xosd * osd);
+
+/* xosd_context_create -- Create a context for several xosd "objects"
+ *
+ * Every display created by xosd_create() opens its own X11 connection and
+ * runs its own event thread. Displays created by xosd_create_in_context()
+ * share those of the context instead, so each one only costs a window and
+ * its pixmaps.
+ *
+ * RETURNS
+ *     A new context, NULL on failure.
+ */
+  xosd_context *xosd_context_create(void);
+
+/* xosd_create_in_context -- Create a new xosd "object" in a context
+ *
+ * ARGUMENTS
+ *     context        The context created by xosd_context_create().
+ *     number_lines   Number of lines of the display.
+ *
+ * RETURNS
+ *     A new xosd structure, NULL on failure.
+ */
+  xosd *xosd_create_in_context(xosd_context * context, int number_lines);
+
+/* xosd_context_destroy -- Destroy a context
+ *
+ * All xosd "objects" of the context must have been destroyed before.
+ *
+ * ARGUMENTS
+ *     context  The context to destroy.
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+ */
+  int xosd_context_destroy(xosd_context * context);
+
 /* xosd_init -- Create a new xosd "object" -- deprecated by xosd_create
  *
  * ARGUMENTS
@@ -124,15 +285,109 @@ extern "C"
  *                  int     (between 0 and 100) if "command" is
  *                          "XOSD_percentage",
  *                  char *  if "command" is "XOSD_string",
+ *                  char *  and its arguments if "command" is
+ *                          "XOSD_printf",
+ *                  char *  if "command" is "XOSD_borrowed"; the text is
+ *                          not copied and must stay unchanged until
+ *                          the line is replaced, scrolled out or the
+ *                          display is destroyed,
  *                  int     (between 0 and 100) if "command" is
  *                          "XOSD_slider".
  * RETURNS
  *     The percentage (between 0 and 100) for "XOSD_percentage" or
  *     "XOSD_slider", or the number of characters displayed for
- *     "XOSD_string". -1 is returned on failure.
+ *     text. -1 is returned on failure, also if the display was hidden and
+ *     could not be shown because no font could be loaded.
  */
   int xosd_display(xosd * osd, int line, xosd_command command, ...);
 
+/* xosd_display_async -- Display information without waiting
+ *
+ * Like xosd_display(), but never blocks the caller, even when the display
+ * still has to be mapped.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     line     Which one of "NLINES" to display.
+ *     command  The type of information to display.
+ *     ...      The argument to "command", see xosd_display().
+ *
+ * RETURNS
+ *     A ticket for xosd_wait_ticket() and xosd_ticket_done(), 0 when called
+ *     between xosd_begin_update() and xosd_commit(), or -1 on failure.
+ */
+  long xosd_display_async(xosd * osd, int line, xosd_command command, ...);
+
+/* xosd_wait_ticket -- Wait until a command has been displayed
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     ticket   A ticket returned by xosd_display_async().
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+ */
+  int xosd_wait_ticket(xosd * osd, long ticket);
+
+/* xosd_ticket_done -- Check if a command has been displayed
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     ticket   A ticket returned by xosd_display_async().
+ *
+ * RETURNS
+ *   1 if the command has been displayed
+ *   0 if it is still pending
+ *  -1 on failure
+ */
+  int xosd_ticket_done(xosd * osd, long ticket);
+
+/* xosd_set_async -- Never wait for the display to be mapped
+ *
+ * By default xosd_display(), xosd_show() and xosd_commit() wait until a
+ * hidden display has been mapped. After enabling asynchronous mode they
+ * return at once.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     async    1 to enable, 0 to disable asynchronous mode.
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+ */
+  int xosd_set_async(xosd * osd, int async);
+
+/* xosd_begin_update -- Start a batch of updates
+ *
+ * All following display and configuration calls from the same thread are
+ * collected and drawn at once by xosd_commit(), so no half-updated display
+ * is ever shown. Batches may be nested; only the outermost xosd_commit()
+ * draws. Changes by other threads are also drawn not before then, and their
+ * xosd_begin_update() waits for the commit.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+ */
+  int xosd_begin_update(xosd * osd);
+
+/* xosd_commit -- Draw all updates collected since xosd_begin_update
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure (no batch started by this thread, or the display was to be
+ *     shown but no font could be loaded)
+ */
+  int xosd_commit(xosd * osd);
+
 /* xosd_is_onscreen -- Returns weather the display is show
  *
  * ARGUMENTS
@@ -156,7 +411,43 @@ extern "C"
  */
   int xosd_wait_until_no_display(xosd * osd);
 
+/* xosd_get_event_fd -- Get a file descriptor signalling display events
+ *
+ * The descriptor becomes readable when the display was shown, hidden or
+ * redrawn, so it can be watched by poll() or epoll instead of a thread
+ * blocking in xosd_wait_until_no_display(). Events are only collected once
+ * this was called; use xosd_is_onscreen() for the state before that. The
+ * descriptor belongs to the display and is closed by xosd_destroy().
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *
+ * RETURNS
+ *     The file descriptor, the same one on every call
+ *    -1 on failure
+ */
+  int xosd_get_event_fd(xosd * osd);
+
+/* xosd_read_events -- Take the events signalled by xosd_get_event_fd
+ *
+ * Never blocks. Events of the same kind since the last call are reported
+ * once; xosd_is_onscreen() tells the current state if both XOSD_event_show
+ * and XOSD_event_hide are reported.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *
+ * RETURNS
+ *     The xosd_event bits since the last call, 0 if there were none
+ *    -1 on failure (no xosd_get_event_fd() before)
+ */
+  int xosd_read_events(xosd * osd);
+
 /* xosd_hide -- hide the display
+ *
+ * Also hides what was posted before by xosd_display_async(), even if it is
+ * not shown yet. Returns without waiting for the window to be unmapped;
+ * hiding a display which is not shown does nothing.
  *
  * ARGUMENTS
  *     osd      The xosd "object".
@@ -168,13 +459,17 @@ extern "C"
   int xosd_hide(xosd * osd);
 
 /* xosd_show -- Show the display after being hidden
+ *
+ * In asynchronous mode and between xosd_begin_update() and xosd_commit()
+ * this returns 0 before the display is mapped.
  *
  * ARGUMENTS
  *     osd      The xosd "object".
  *
  * RETURNS
  *   0 on success
- *  -1 on failure
+ *  -1 on failure, if the display was shown already, or if no font could
+ *     be loaded
  */
   int xosd_show(xosd * osd);
 
@@ -294,7 +589,22 @@ extern "C"
 */
   int xosd_set_timeout(xosd * osd, int timeout);
 
+/* xosd_set_timeout_ms -- Change the time before display is hidden.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     timeout  The number of milliseconds before the display is hidden.
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+*/
+  int xosd_set_timeout_ms(xosd * osd, int timeout);
+
 /* xosd_set_colour -- Change the colour of the display
+ *
+ * Colours are remembered, so only the first use of a colour waits for the
+ * X server.
  *
  * ARGUMENTS
  *     osd      The xosd "object".
@@ -345,6 +655,56 @@ extern "C"
 */
   int xosd_scroll(xosd * osd, int lines);
 
+/* xosd_set_cache_size -- Change the memory budget of the line cache
+ *
+ * Recently drawn text lines are kept as X pixmaps, so displaying the same
+ * text again is just a copy.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     bytes    Maximum estimated X server memory used, 0 disables the cache.
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+*/
+  int xosd_set_cache_size(xosd * osd, int bytes);
+
+/* xosd_get_stats -- Get the counters of the display
+ *
+ * The counters are updated by the event thread, so they might not yet
+ * include the latest calls. If the environment variable XOSD_STATS is set
+ * to a number of seconds when the display is created, the event thread
+ * also prints the counters of all its displays to stderr that often.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     stats    Filled with the current counters.
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+*/
+  int xosd_get_stats(xosd * osd, struct xosd_stats *stats);
+
+/* xosd_text_extents -- Measure text as it would be displayed
+ *
+ * Uses the current font, outline and shadow of the display, so text can be
+ * laid out, e.g. truncated to fit the screen, without drawing it.
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object".
+ *     string   The text in the current locale.
+ *     width    Return value for the width in pixels, may be NULL.
+ *     height   Return value for the height of a line in pixels, may be NULL.
+ *
+ * RETURNS
+ *   0 on success
+ *  -1 on failure
+*/
+  int xosd_text_extents(xosd * osd, const char *string, int *width,
+                        int *height);
+
 /* xosd_get_number_lines -- Get the maximum number of lines allowed
  *
  * ARGUMENTS
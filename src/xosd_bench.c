@@ -0,0 +1,655 @@
+/* xosd_bench -- measure the cost of libxosd API calls
+ *
+ * Every scenario calls the public API in a tight loop and reports the cost
+ * per call as seen by the caller, its median and 99th percentile, and the
+ * cost per call including the time the event thread needs to apply and draw
+ * all of them. With -j the results are printed as one JSON object per line.
+ * It uses API added after 2.2.15 (xosd_get_stats(), contexts, unthreaded and
+ * asynchronous displays), so it only runs against a libxosd providing it;
+ * builds of such versions can be compared through LD_LIBRARY_PATH.
+ * With glibc the heap allocations of all threads are counted as well, which
+ * shows whether updating the display allocates in the steady state.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <locale.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "xosd.h"
+
+#ifdef __GLIBC__
+/* Count calls of the allocator by wrapping the glibc entry points. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *
+malloc(size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_realloc(ptr, size);
+}
+#define ALLOCS() __sync_add_and_fetch(&allocs, 0)
+#else
+#define ALLOCS() 0UL
+#endif
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* State of one run of a scenario. */
+struct bench
+{
+  xosd *osd;                    /* display shared by all scenarios */
+  xosd *target;                 /* display drained and counted, osd or own */
+  xosd_context *ctx;            /* of create_shared */
+  int fd;                       /* of frame_event */
+  int arg;                      /* sweep value */
+};
+
+static void
+display_text(struct bench *b, int i)
+{
+  xosd_display(b->osd, 0, XOSD_printf, "Volume %d", i % 100);
+}
+
+static void
+cycle_text(struct bench *b, int i)
+{
+  static const char *text[] = { "Volume", "Muted", "Playing", "On", "Off" };
+  xosd_display(b->osd, 0, XOSD_string, text[i % 5]);
+}
+
+static void
+borrowed_text(struct bench *b, int i)
+{
+  static const char *text[] = { "Volume", "Muted", "Playing", "On", "Off" };
+  xosd_display(b->osd, 0, XOSD_borrowed, text[i % 5]);
+}
+
+static void
+long_text(struct bench *b, int i)
+{
+  static const char *text = "The quick brown fox jumps over the lazy dog, "
+    "then runs across the whole screen and past the end of the line";
+  xosd_display(b->osd, 0, XOSD_printf, "%d: %s", i % 100, text);
+}
+
+static void
+same_text(struct bench *b, int i)
+{
+  xosd_display(b->osd, 0, XOSD_string, "Volume");
+}
+
+static void
+text_extents(struct bench *b, int i)
+{
+  static const char *text[] = { "Volume", "Muted", "Playing", "On", "Off" };
+  int width, height;
+  xosd_text_extents(b->osd, text[i % 5], &width, &height);
+}
+
+static void
+display_bar(struct bench *b, int i)
+{
+  xosd_display(b->osd, 1, XOSD_percentage, i % 101);
+}
+
+static void
+display_slider(struct bench *b, int i)
+{
+  xosd_display(b->osd, 1, XOSD_slider, i % 101);
+}
+
+/* Both lines as bars, e.g. volume and balance. */
+static void
+two_bars(struct bench *b, int i)
+{
+  xosd_display(b->osd, 0, XOSD_percentage, i % 101);
+  xosd_display(b->osd, 1, XOSD_slider, 100 - i % 101);
+}
+
+static void
+display_async(struct bench *b, int i)
+{
+  xosd_display_async(b->osd, 1, XOSD_percentage, i % 101);
+}
+
+static void
+set_timeout(struct bench *b, int i)
+{
+  xosd_set_timeout(b->osd, 30 + (i & 1));
+}
+
+static void
+set_colour(struct bench *b, int i)
+{
+  xosd_set_colour(b->osd, (i & 1) ? "red" : osd_default_colour);
+}
+
+static void
+reset_colour(struct bench *b)
+{
+  xosd_set_colour(b->osd, osd_default_colour);
+}
+
+static void
+set_font(struct bench *b, int i)
+{
+  xosd_set_font(b->osd, (i & 1) ? "fixed" : osd_default_font);
+}
+
+static void
+reset_font(struct bench *b)
+{
+  xosd_set_font(b->osd, osd_default_font);
+}
+
+static void
+batch(struct bench *b, int i)
+{
+  xosd_begin_update(b->osd);
+  xosd_display(b->osd, 0, XOSD_string, "Volume");
+  xosd_display(b->osd, 1, XOSD_percentage, i % 101);
+  xosd_commit(b->osd);
+}
+
+static void
+outline_on(struct bench *b)
+{
+  xosd_set_outline_offset(b->osd, b->arg);
+}
+
+static void
+outline_off(struct bench *b)
+{
+  xosd_set_outline_offset(b->osd, 0);
+}
+
+/* Time until the event descriptor reports the new frame. */
+static void
+events_on(struct bench *b)
+{
+  b->fd = xosd_get_event_fd(b->osd);
+  xosd_read_events(b->osd);
+}
+
+static void
+frame_event(struct bench *b, int i)
+{
+  struct pollfd p;
+  p.fd = b->fd;
+  p.events = POLLIN;
+  xosd_display_async(b->osd, 0, XOSD_printf, "Volume %d", i % 100);
+  while (b->fd != -1 && poll(&p, 1, 1000) == 1)
+    if (xosd_read_events(b->osd) & XOSD_event_frame)
+      break;
+}
+
+/* Tail of a log like osd_cat shows it, on a display of its own. */
+static void
+log_create(struct bench *b)
+{
+  b->target = xosd_create(50);
+  if (b->target)
+    xosd_set_timeout(b->target, 30);
+  else
+    b->target = b->osd;
+}
+
+static void
+scroll_log(struct bench *b, int i)
+{
+  if (b->target == b->osd)
+    return;
+  xosd_scroll(b->target, 1);
+  xosd_display(b->target, 49, XOSD_printf, "Log line %d", i);
+}
+
+static void
+log_destroy(struct bench *b)
+{
+  if (b->target != b->osd)
+    xosd_destroy(b->target);
+}
+
+/* Display without event thread, as the xmms and bmp plugins use it. */
+static void
+unthreaded_create(struct bench *b)
+{
+  b->target = xosd_create_unthreaded(2);
+  if (b->target) {
+    xosd_set_timeout(b->target, 30);
+    xosd_display(b->target, 0, XOSD_string, "xosd_bench");
+  } else
+    b->target = b->osd;
+}
+
+static void
+unthreaded(struct bench *b, int i)
+{
+  xosd_display(b->target, 1, XOSD_printf, "Volume %d", i % 100);
+}
+
+/* Posted changes drawn by the main loop, like the GLib source does. */
+static void
+unthreaded_async(struct bench *b, int i)
+{
+  xosd_display_async(b->target, 1, XOSD_percentage, i % 101);
+  if (b->target != b->osd)
+    xosd_dispatch(b->target);
+}
+
+static void
+unthreaded_destroy(struct bench *b)
+{
+  if (b->target != b->osd)
+    xosd_destroy(b->target);
+}
+
+/* Display of its own, as osd_cat creates it for every message. */
+static void
+create_destroy(struct bench *b, int i)
+{
+  xosd_destroy(xosd_create(1));
+}
+
+static void
+context_create(struct bench *b)
+{
+  b->ctx = xosd_context_create();
+}
+
+static void
+create_shared(struct bench *b, int i)
+{
+  if (b->ctx)
+    xosd_destroy(xosd_create_in_context(b->ctx, 1));
+}
+
+static void
+context_destroy(struct bench *b)
+{
+  if (b->ctx)
+    xosd_context_destroy(b->ctx);
+}
+
+/* Several threads updating the same display, each its own line. */
+static void
+threads(struct bench *b, int i)
+{
+  xosd_display(b->osd, i & 1, XOSD_printf, "Volume %d", i % 100);
+}
+
+/* Producers never waiting, which stresses handing commands over. */
+static void
+threads_async(struct bench *b, int i)
+{
+  xosd_display_async(b->osd, 1, XOSD_percentage, i % 101);
+}
+
+/* Producers all waiting for their results. */
+static void
+threads_sync(struct bench *b, int i)
+{
+  xosd_text_extents(b->osd, "Volume", NULL, NULL);
+}
+
+/* Scenarios with a sweep are run once for each arg from 0 to sweep, those
+ * with threads with 2^arg threads calling concurrently. Slow scenarios only
+ * make every scale-th call. */
+static const struct scenario
+{
+  const char *name;
+  void (*call) (struct bench * b, int i);
+  void (*setup) (struct bench * b);
+  void (*teardown) (struct bench * b);
+  int sweep;
+  int threaded;
+  int scale;
+} scenarios[] = {
+  {"display_text", display_text, NULL, NULL, 0, 0, 1},
+  {"cycle_text", cycle_text, NULL, NULL, 0, 0, 1},
+  {"borrowed_text", borrowed_text, NULL, NULL, 0, 0, 1},
+  {"long_text", long_text, NULL, NULL, 0, 0, 1},
+  {"same_text", same_text, NULL, NULL, 0, 0, 1},
+  {"text_extents", text_extents, NULL, NULL, 0, 0, 1},
+  {"display_bar", display_bar, NULL, NULL, 0, 0, 1},
+  {"display_slider", display_slider, NULL, NULL, 0, 0, 1},
+  {"two_bars", two_bars, NULL, NULL, 0, 0, 1},
+  {"display_async", display_async, NULL, NULL, 0, 0, 1},
+  {"set_timeout", set_timeout, NULL, NULL, 0, 0, 1},
+  {"set_colour", set_colour, NULL, reset_colour, 0, 0, 1},
+  {"set_font", set_font, NULL, reset_font, 0, 0, 1},
+  {"batch", batch, NULL, NULL, 0, 0, 1},
+  {"frame_event", frame_event, events_on, NULL, 0, 0, 1},
+  {"outline", display_text, outline_on, outline_off, 8, 0, 1},
+  {"scroll_log", scroll_log, log_create, log_destroy, 0, 0, 1},
+  {"unthreaded", unthreaded, unthreaded_create, unthreaded_destroy, 0, 0, 1},
+  {"unthreaded_async", unthreaded_async, unthreaded_create,
+   unthreaded_destroy, 0, 0, 1},
+  {"create_destroy", create_destroy, NULL, NULL, 0, 0, 100},
+  {"create_shared", create_shared, context_create, context_destroy,
+   0, 0, 10},
+  {"threads", threads, NULL, NULL, 4, 1, 1},
+  {"threads_async", threads_async, NULL, NULL, 4, 1, 1},
+  {"threads_sync", threads_sync, NULL, NULL, 4, 1, 1},
+  {NULL, NULL, NULL, NULL, 0, 0, 0}
+};
+
+static void
+usage(const char *prog)
+{
+  const struct scenario *s;
+  fprintf(stderr, "Usage: %s [-j] [-n COUNT] [-r core|xft|image] "
+          "[SCENARIO]...\n"
+          "       %s [-j] [-n COUNT] [-r core|xft|image] -t\n"
+          "Scenarios:", prog, prog);
+  for (s = scenarios; s->name; s++)
+    fprintf(stderr, " %s", s->name);
+  fprintf(stderr, "\n");
+}
+
+static int json;
+
+/* Calls of one thread, every step-th starting at first. */
+struct worker
+{
+  pthread_t thread;
+  struct bench *b;
+  const struct scenario *s;
+  double *latency;
+  int first, step, n;
+};
+
+static void *
+work(void *arg)
+{
+  struct worker *w = arg;
+  double start, end;
+  int i;
+
+  start = now();
+  for (i = w->first; i < w->n; i += w->step) {
+    w->s->call(w->b, i);
+    end = now();
+    w->latency[i] = end - start;
+    start = end;
+  }
+  return NULL;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Return the p-th percentile of the sorted latencies in us. */
+static double
+percentile(const double *latency, int n, double p)
+{
+  int i = (int) (p / 100 * n);
+  return latency[(i < n) ? i : n - 1] * 1e6;
+}
+
+static void
+run(xosd * osd, const struct scenario *s, int calls)
+{
+  double start, called, done, *latency;
+  struct xosd_stats before, after;
+  struct worker workers[16];
+  struct bench b;
+  unsigned long allocated;
+  char name[32];
+  int arg, t, count, n = calls / s->scale;
+
+  if (n == 0)
+    n = 1;
+  latency = malloc(n * sizeof(double));
+  if (latency == NULL)
+    return;
+  for (arg = 0; arg <= s->sweep; arg++) {
+    count = s->threaded ? 1 << arg : 1;
+    memset(&b, 0, sizeof(b));
+    b.osd = b.target = osd;
+    b.arg = arg;
+    if (s->setup)
+      s->setup(&b);
+    for (t = 0; t < count; t++) {
+      workers[t].b = &b;
+      workers[t].s = s;
+      workers[t].latency = latency;
+      workers[t].first = t;
+      workers[t].step = count;
+      workers[t].n = n;
+    }
+
+    xosd_get_stats(b.target, &before);
+    allocated = ALLOCS();
+    start = now();
+    if (count == 1)
+      work(&workers[0]);
+    else {
+      for (t = 0; t < count; t++)
+        pthread_create(&workers[t].thread, NULL, work, &workers[t]);
+      for (t = 0; t < count; t++)
+        pthread_join(workers[t].thread, NULL);
+    }
+    called = now();
+    /* A synchronous call returns only after all previous calls are drawn. */
+    xosd_text_extents(b.target, "", NULL, NULL);
+    done = now();
+    allocated = ALLOCS() - allocated;
+    xosd_get_stats(b.target, &after);
+    if (s->teardown)
+      s->teardown(&b);
+
+    qsort(latency, n, sizeof(double), compare);
+    if (s->sweep)
+      snprintf(name, sizeof(name), "%s/%d", s->name,
+               s->threaded ? count : arg);
+    else
+      snprintf(name, sizeof(name), "%s", s->name);
+    if (json)
+      printf("{\"scenario\": \"%s\", \"calls\": %d, \"threads\": %d, "
+             "\"ops_per_sec\": %.1f, \"us_per_call\": %.3f, "
+             "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, "
+             "\"max_us\": %.3f, \"drawn_us_per_call\": %.3f, "
+             "\"frames_per_sec\": %.1f, "
+             "\"kib_per_frame\": %.3f, \"allocs_per_call\": %.4f}\n",
+             name, n, count, n / (done - start),
+             (called - start) * 1e6 / n, percentile(latency, n, 50),
+             percentile(latency, n, 99), percentile(latency, n, 99.9),
+             latency[n - 1] * 1e6, (done - start) * 1e6 / n,
+             (after.frames - before.frames) / (done - start),
+             (after.frames == before.frames) ? 0.0 :
+             (after.image_bytes - before.image_bytes) / 1024.0 /
+             (after.frames - before.frames), (double) allocated / n);
+    else
+      printf("%-16s %8d calls %10.2f us/call %8.2f us p50 %8.2f us p99 "
+             "%10.2f us/call drawn %8.1f frames/s %10.1f KiB/frame "
+             "%8.3f allocs/call\n", name, n, (called - start) * 1e6 / n,
+             percentile(latency, n, 50), percentile(latency, n, 99),
+             (done - start) * 1e6 / n,
+             (after.frames - before.frames) / (done - start),
+             (after.frames == before.frames) ? 0.0 :
+             (after.image_bytes - before.image_bytes) / 1024.0 /
+             (after.frames - before.frames), (double) allocated / n);
+  }
+  free(latency);
+}
+
+/* Time from xosd_create() until the first frame was drawn, as seen by a
+ * program like osd_cat, which creates a new display for every message. */
+static int
+startup(int n)
+{
+  double start, created, shown, create = 0, first = 0, best = 0;
+  xosd *osd;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    start = now();
+    osd = xosd_create(1);
+    if (!osd) {
+      fprintf(stderr, "ERROR: %s\n", xosd_error);
+      return EXIT_FAILURE;
+    }
+    created = now();
+    /* Returns once the window is mapped and its content sent. */
+    xosd_display(osd, 0, XOSD_string, "xosd_bench");
+    shown = now();
+    xosd_destroy(osd);
+
+    create += created - start;
+    first += shown - start;
+    if (i == 0 || shown - start < best)
+      best = shown - start;
+  }
+  if (json)
+    printf("{\"scenario\": \"startup\", \"runs\": %d, "
+           "\"create_ms\": %.3f, \"first_frame_ms\": %.3f, "
+           "\"best_ms\": %.3f}\n", n, create * 1e3 / n, first * 1e3 / n,
+           best * 1e3);
+  else
+    printf("%-16s %8d runs %10.2f ms create %10.2f ms first frame "
+           "%10.2f ms best\n", "startup", n, create * 1e3 / n,
+           first * 1e3 / n, best * 1e3);
+  return EXIT_SUCCESS;
+}
+
+static void
+print_stats(xosd * osd)
+{
+  static const char *stages[XOSD_STAGES] = {
+    "size", "pos", "lines", "mask", "copy", "flush", "wait"
+  };
+  struct xosd_stats st;
+  int i;
+
+  xosd_get_stats(osd, &st);
+  if (json) {
+    printf("{\"stats\": {\"cache_hits\": %lu, \"cache_misses\": %lu, "
+           "\"cache_evictions\": %lu, \"extents_hits\": %lu, "
+           "\"extents_misses\": %lu, \"redraws_suppressed\": %lu, "
+           "\"wakeups\": %lu, \"select_timeouts\": %lu, "
+           "\"expose_events\": %lu", st.cache_hits, st.cache_misses,
+           st.cache_evictions, st.extents_hits, st.extents_misses,
+           st.redraws_suppressed, st.wakeups, st.select_timeouts,
+           st.expose_events);
+    for (i = 0; i < XOSD_STAGES; i++)
+      if (st.stages[i].count)
+        printf(", \"%s_mean_us\": %.3f, \"%s_max_us\": %.3f", stages[i],
+               st.stages[i].total_ns / 1e3 / st.stages[i].count, stages[i],
+               st.stages[i].max_ns / 1e3);
+    printf("}}\n");
+    return;
+  }
+  printf("cache: %lu hits %lu misses %lu evictions %lu entries %lu bytes\n",
+         st.cache_hits, st.cache_misses, st.cache_evictions,
+         st.cache_entries, st.cache_bytes);
+  printf("extents: %lu hits %lu misses\n", st.extents_hits,
+         st.extents_misses);
+  printf("window: %lu bytes\n", st.pixmap_bytes);
+  printf("unchanged: %lu redraws suppressed\n", st.redraws_suppressed);
+  printf("events: %lu wakeups %lu timeouts %lu exposes\n", st.wakeups,
+         st.select_timeouts, st.expose_events);
+  for (i = 0; i < XOSD_STAGES; i++)
+    if (st.stages[i].count)
+      printf("stage %-5s %8lu times %10.2f us mean %10.2f us max\n",
+             stages[i], st.stages[i].count,
+             st.stages[i].total_ns / 1e3 / st.stages[i].count,
+             st.stages[i].max_ns / 1e3);
+}
+
+int
+main(int argc, char *argv[])
+{
+  const struct scenario *s;
+  xosd *osd;
+  int c, i, n = 0, time_startup = 0;
+
+  setlocale(LC_ALL, "");
+
+  while ((c = getopt(argc, argv, "jn:r:th")) != -1) {
+    switch (c) {
+    case 'j':
+      json = 1;
+      break;
+    case 't':
+      time_startup = 1;
+      break;
+    case 'r':
+      /* Select the text renderer used by xosd_create(). */
+      setenv("XOSD_RENDER", optarg, 1);
+      break;
+    case 'n':
+      n = atoi(optarg);
+      if (n > 0)
+        break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (time_startup)
+    return startup(n ? n : 100);
+  if (n == 0)
+    n = 10000;
+
+  osd = xosd_create(2);
+  if (!osd) {
+    fprintf(stderr, "ERROR: %s\n", xosd_error);
+    return EXIT_FAILURE;
+  }
+  xosd_set_timeout(osd, 30);
+  /* Map the window first, so the wait for it is not measured. */
+  xosd_display(osd, 0, XOSD_string, "xosd_bench");
+
+  if (optind == argc)
+    for (s = scenarios; s->name; s++)
+      run(osd, s, n);
+  for (i = optind; i < argc; i++) {
+    for (s = scenarios; s->name; s++)
+      if (strcmp(s->name, argv[i]) == 0)
+        break;
+    if (s->name == NULL) {
+      usage(argv[0]);
+      xosd_destroy(osd);
+      return EXIT_FAILURE;
+    }
+    run(osd, s, n);
+  }
+
+  print_stats(osd);
+  xosd_destroy(osd);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,33 @@
+#ifndef XOSD_GLIB_H
+#define XOSD_GLIB_H
+
+/* Drive a display created by xosd_create_unthreaded() from the GLib main
+ * loop, as used by GTK programs. Link with -lxosd_glib. */
+
+#include <glib.h>
+#include <xosd.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* xosd_source_add -- Let the GLib main loop drive a display
+ *
+ * Polls the descriptors of the display and calls xosd_dispatch() when one of
+ * them gets readable or xosd_next_timeout() has passed. Remove the source by
+ * g_source_remove() before calling xosd_destroy().
+ *
+ * ARGUMENTS
+ *     osd      The xosd "object" created by xosd_create_unthreaded().
+ *
+ * RETURNS
+ *     The id of the source, 0 on failure.
+ */
+  guint xosd_source_add(xosd * osd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
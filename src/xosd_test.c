@@ -0,0 +1,300 @@
+/* xosd_test -- checks of libxosd needing an X server
+ *
+ * Run by "make check". Without DISPLAY the test is skipped, so run it as
+ * "xvfb-run -a make check" where no X server is available. The parts of the
+ * library working without a server are checked by libxosd/xosd_check.
+ * With glibc the heap allocations of all threads are counted, which shows
+ * whether updating the display allocates in the steady state.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+
+#include "xosd.h"
+
+#ifdef __GLIBC__
+/* Count calls of the allocator by wrapping the glibc entry points. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *
+malloc(size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  __sync_add_and_fetch(&allocs, 1);
+  return __libc_realloc(ptr, size);
+}
+#define ALLOCS() __sync_add_and_fetch(&allocs, 0)
+#endif
+
+/* Wait until everything posted before is drawn. */
+static void
+drain(xosd * osd)
+{
+  xosd_text_extents(osd, "", NULL, NULL);
+}
+
+/* Checks, each returns 0 if it passed. {{{ */
+
+/* The default font is only loaded when a display is first shown. */
+static int
+check_destroy_unshown(xosd * osd)
+{
+  xosd *o = xosd_create(1);
+  return (o == NULL) ? -1 : xosd_destroy(o);
+}
+
+static int
+check_destroy_unshown_shared(xosd * osd)
+{
+  xosd_context *ctx = xosd_context_create();
+  xosd *o;
+  int ret;
+
+  if (ctx == NULL)
+    return -1;
+  o = xosd_create_in_context(ctx, 1);
+  ret = (o == NULL) ? -1 : xosd_destroy(o);
+  if (xosd_context_destroy(ctx) == -1)
+    ret = -1;
+  return ret;
+}
+
+/* A hide must not be overtaken by a show posted before it. */
+static int
+check_hide_async(xosd * osd)
+{
+  long ticket;
+
+  if (xosd_hide(osd) == -1)
+    return -1;
+  ticket = xosd_display_async(osd, 0, XOSD_string, "xosd_test");
+  if (ticket == -1 || xosd_hide(osd) == -1)
+    return -1;
+  /* xosd_hide() does not wait, drain() covers it. */
+  if (xosd_wait_ticket(osd, ticket) == -1)
+    return -1;
+  drain(osd);
+  if (xosd_is_onscreen(osd))
+    return -1;
+  if (xosd_show(osd) == -1 || !xosd_is_onscreen(osd))
+    return -1;
+  return (xosd_show(osd) == -1) ? 0 : -1;
+}
+
+/* xosd_get_colour() returns a colour set before, even if it was cached and
+ * so not waited for. */
+static int
+check_get_colour(xosd * osd)
+{
+  static const char *colours[] = { "red", "green", "red", "green" };
+  int i, red, green;
+
+  for (i = 0; i < 4; i++) {
+    if (xosd_set_colour(osd, colours[i]) == -1
+        || xosd_get_colour(osd, &red, &green, NULL) == -1)
+      return -1;
+    if ((i & 1) ? green <= red : red <= green)
+      return -1;
+  }
+  return 0;
+}
+
+/* A borrowed buffer reused with new content is redrawn, only the same
+ * content again is suppressed. */
+static int
+check_borrowed_reuse(xosd * osd)
+{
+  static char buffer[16];
+  struct xosd_stats st[3];
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    strcpy(buffer, (i == 0) ? "Borrowed 1" : "Borrowed 2");
+    xosd_display(osd, 0, XOSD_borrowed, buffer);
+    drain(osd);
+    xosd_get_stats(osd, &st[i]);
+  }
+  xosd_display(osd, 0, XOSD_string, "xosd_test");
+  return (st[1].redraws_suppressed == st[0].redraws_suppressed
+          && st[2].redraws_suppressed == st[1].redraws_suppressed + 1)
+    ? 0 : -1;
+}
+
+/* Repeated text is drawn from the cache. */
+static int
+check_cache_hits(xosd * osd)
+{
+  struct xosd_stats before, after;
+  int i;
+
+  xosd_get_stats(osd, &before);
+  for (i = 0; i < 10; i++) {
+    xosd_display(osd, 0, XOSD_string, (i & 1) ? "Muted" : "Volume");
+    drain(osd);
+  }
+  xosd_get_stats(osd, &after);
+  xosd_display(osd, 0, XOSD_string, "xosd_test");
+  /* The client rasterizer (XOSD_RENDER=image) has no cache. */
+  if (after.cache_hits + after.cache_misses
+      == before.cache_hits + before.cache_misses)
+    return 0;
+  return (after.cache_hits - before.cache_hits >= 8) ? 0 : -1;
+}
+
+/* Scrolling keeps the lines below in order and blanks the last ones. */
+static int
+check_scroll(xosd * osd)
+{
+  xosd *o = xosd_create(3);
+  int ret = -1;
+
+  if (o == NULL)
+    return -1;
+  if (xosd_display(o, 0, XOSD_string, "one") == -1
+      || xosd_display(o, 1, XOSD_string, "two") == -1
+      || xosd_display(o, 2, XOSD_percentage, 50) == -1
+      || xosd_scroll(o, 1) == -1)
+    goto out;
+  drain(o);
+  /* Showing the same content again is suppressed, so it is where it was
+   * expected to be. */
+  {
+    struct xosd_stats before, after;
+    xosd_get_stats(o, &before);
+    xosd_display(o, 0, XOSD_string, "two");
+    xosd_display(o, 1, XOSD_percentage, 50);
+    drain(o);
+    xosd_get_stats(o, &after);
+    if (after.redraws_suppressed - before.redraws_suppressed == 2)
+      ret = 0;
+  }
+out:
+  xosd_destroy(o);
+  return ret;
+}
+
+/* Updates with changing text and bars must not allocate once the caches,
+ * pools and line buffers have grown to their working size. */
+static void
+update(xosd * osd, int kind, int i)
+{
+  static const char *text[] = { "Volume", "Muted", "Playing", "On", "Off" };
+
+  switch (kind) {
+  case 0:
+    xosd_display(osd, 0, XOSD_printf, "Volume %d", i % 100);
+    break;
+  case 1:
+    xosd_display(osd, 0, XOSD_string, text[i % 5]);
+    break;
+  case 2:
+    xosd_display(osd, 0, XOSD_borrowed, text[i % 5]);
+    break;
+  case 3:
+    xosd_display(osd, 0, XOSD_printf, "%d: %s", i % 100,
+                 "The quick brown fox jumps over the lazy dog, then runs "
+                 "across the whole screen and past the end of the line");
+    break;
+  case 4:
+    xosd_display(osd, 1, XOSD_percentage, i % 101);
+    break;
+  case 5:
+    xosd_display(osd, 1, XOSD_slider, i % 101);
+    break;
+  }
+}
+
+static int
+check_no_allocs(xosd * osd)
+{
+#ifdef __GLIBC__
+  unsigned long allocated;
+  int i, kind, ret = 0;
+
+  for (kind = 0; kind < 6; kind++) {
+    for (i = 0; i < 2000; i++)
+      update(osd, kind, i);
+    drain(osd);
+    allocated = ALLOCS();
+    for (i = 2000; i < 3000; i++)
+      update(osd, kind, i);
+    drain(osd);
+    allocated = ALLOCS() - allocated;
+    if (allocated) {
+      fprintf(stderr, "update %d: %lu allocations in 1000 calls\n", kind,
+              allocated);
+      ret = -1;
+    }
+  }
+  return ret;
+#else
+  return 0;                     /* Allocations are only counted with glibc. */
+#endif
+}
+
+static const struct check
+{
+  const char *name;
+  int (*check) (xosd * osd);
+} checks[] = {
+  {"destroy_unshown", check_destroy_unshown},
+  {"destroy_unshown_shared", check_destroy_unshown_shared},
+  {"hide_async", check_hide_async},
+  {"get_colour", check_get_colour},
+  {"borrowed_reuse", check_borrowed_reuse},
+  {"cache_hits", check_cache_hits},
+  {"scroll", check_scroll},
+  {"no_allocs", check_no_allocs},
+  {NULL, NULL}
+};
+
+/* }}} */
+
+int
+main(int argc, char *argv[])
+{
+  const struct check *c;
+  xosd *osd;
+  int failed = 0;
+
+  setlocale(LC_ALL, "");
+  if (getenv("DISPLAY") == NULL) {
+    printf("No X server in DISPLAY, skipped\n");
+    return 77;                  /* automake: test skipped */
+  }
+
+  osd = xosd_create(2);
+  if (!osd) {
+    fprintf(stderr, "ERROR: %s\n", xosd_error);
+    return EXIT_FAILURE;
+  }
+  xosd_set_timeout(osd, 30);
+  xosd_display(osd, 0, XOSD_string, "xosd_test");
+
+  for (c = checks; c->name; c++) {
+    int ret = c->check(osd);
+    printf("%-24s %s\n", c->name, (ret == 0) ? "ok" : "FAILED");
+    if (ret != 0)
+      failed++;
+  }
+  xosd_destroy(osd);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}